@@ -1,5 +1,8 @@
 #include "tusb.h"
+#include "pico/platform.h"
+#include "pico/time.h"
 #include "pico/unique_id.h"
+#include "hardware/structs/systick.h"
 
 #include <stdarg.h>
 
@@ -13,7 +16,7 @@
  */
 
 // Read bytes (blocks until buffer_size is reached)
-uint32_t fast_serial_read(const char * buffer, uint32_t buffer_size){
+uint32_t __not_in_flash_func(fast_serial_read)(const char * buffer, uint32_t buffer_size){
 	uint32_t buffer_idx = 0;
 	while(buffer_idx < buffer_size){
 		uint32_t buffer_avail = buffer_size - buffer_idx;
@@ -32,8 +35,33 @@ uint32_t fast_serial_read(const char * buffer, uint32_t buffer_size){
 	return buffer_size;
 }
 
+// Read bytes, giving up if none arrive for timeout_us. Returns the number read.
+uint32_t fast_serial_read_timeout(const char * buffer, uint32_t buffer_size, uint32_t timeout_us){
+	uint32_t buffer_idx = 0;
+	uint64_t last_read = time_us_64();
+	while(buffer_idx < buffer_size){
+		uint32_t buffer_avail = buffer_size - buffer_idx;
+		uint32_t read_avail = fast_serial_read_available();
+
+		if(read_avail > 0){
+			if(buffer_avail > read_avail){
+				buffer_avail = read_avail;
+			}
+
+			buffer_idx += fast_serial_read_atomic(buffer + buffer_idx, buffer_avail);
+			last_read = time_us_64();
+		}
+		else if(time_us_64() - last_read > timeout_us){
+			break;
+		}
+
+		fast_serial_task();
+	}
+	return buffer_idx;
+}
+
 // Read bytes until terminator reached (blocks until terminator or buffer_size is reached)
-uint32_t fast_serial_read_until(char * buffer, uint32_t buffer_size, char until){
+uint32_t __not_in_flash_func(fast_serial_read_until)(char * buffer, uint32_t buffer_size, char until){
 	uint32_t buffer_idx = 0;
 	while(buffer_idx < buffer_size - 1){
 		while(fast_serial_read_available() > 0){
@@ -55,8 +83,52 @@ uint32_t fast_serial_read_until(char * buffer, uint32_t buffer_size, char until)
 	return buffer_idx;
 }
 
-// Write bytes (without flushing, so limited to 64 bytes)
-uint32_t fast_serial_write(const char * buffer, uint32_t buffer_size){
+// Capture state: while capture_buffer is set, core 0's writes go there
+// instead of USB (core 1's debug output is never captured)
+static char * capture_buffer = NULL;
+static uint32_t capture_size = 0;
+static uint32_t capture_len = 0;
+static bool capture_overflow = false;
+
+void fast_serial_capture_start(char * buffer, uint32_t buffer_size){
+	capture_buffer = buffer;
+	capture_size = buffer_size;
+	capture_len = 0;
+	capture_overflow = false;
+}
+
+uint32_t fast_serial_capture_end(bool * overflow){
+	capture_buffer = NULL;
+	*overflow = capture_overflow;
+	return capture_len;
+}
+
+// CRC-16/CCITT-FALSE (polynomial 0x1021), continuing from crc (start at 0xFFFF)
+uint16_t fast_serial_crc16(const void * buffer, uint32_t buffer_size, uint16_t crc){
+	const uint8_t * bytes = buffer;
+	for(uint32_t i = 0; i < buffer_size; i++){
+		crc ^= bytes[i] << 8;
+		for(int bit = 0; bit < 8; bit++){
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+// SysTick cycles spent in fast_serial_write (see fast_serial.h)
+uint64_t fast_serial_write_cycles = 0;
+
+static uint32_t write_bytes(const char * buffer, uint32_t buffer_size){
+	if(capture_buffer != NULL && get_core_num() == 0){
+		uint32_t space = capture_size - capture_len;
+		if(buffer_size > space){
+			capture_overflow = true;
+		}
+		uint32_t len = buffer_size < space ? buffer_size : space;
+		memcpy(capture_buffer + capture_len, buffer, len);
+		capture_len += len;
+		return buffer_size;
+	}
 	uint32_t buffer_idx = 0;
 	while(buffer_idx < buffer_size){
 		uint32_t write_avail = fast_serial_write_available();
@@ -74,6 +146,19 @@ uint32_t fast_serial_write(const char * buffer, uint32_t buffer_size){
 	return buffer_size;
 }
 
+// Write bytes (without flushing)
+uint32_t fast_serial_write(const char * buffer, uint32_t buffer_size){
+	// only core 0 is counted: each core has its own SysTick, and core 1
+	// must not race core 0 on the counter
+	if(get_core_num() != 0){
+		return write_bytes(buffer, buffer_size);
+	}
+	uint32_t start = systick_hw->cvr;
+	uint32_t written = write_bytes(buffer, buffer_size);
+	fast_serial_write_cycles += (start - systick_hw->cvr) & 0xFFFFFF;
+	return written;
+}
+
 int fast_serial_printf(const char * format, ...){
 	va_list va;
 	va_start(va, format);
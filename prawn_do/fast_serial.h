@@ -45,6 +45,10 @@ static inline uint32_t fast_serial_read_atomic(const char * buffer, uint32_t buf
 // Read bytes (blocks until buffer_size is reached)
 uint32_t fast_serial_read(const char * buffer, uint32_t buffer_size);
 
+// Read bytes (blocks until buffer_size is reached, or no byte has arrived for
+// timeout_us). Returns the number of bytes read.
+uint32_t fast_serial_read_timeout(const char * buffer, uint32_t buffer_size, uint32_t timeout_us);
+
 // Read bytes until terminator reached (blocks until terminator or buffer_size is reached)
 // Adds null terminator to buffer after read completes (reserving one byte in buffer for this)
 uint32_t fast_serial_read_until(char * buffer, uint32_t buffer_size, char until);
@@ -62,9 +66,25 @@ static inline uint32_t fast_serial_write_atomic(const char * buffer, uint32_t bu
 // Write bytes (without flushing)
 uint32_t fast_serial_write(const char * buffer, uint32_t buffer_size);
 
+// Clock cycles core 0 spent in fast_serial_write, counted by its SysTick
+// timer if it is running (each call is counted modulo 2^24 cycles). Writes
+// from core 1 are not counted.
+extern uint64_t fast_serial_write_cycles;
+
 // print via fast_serial_write
 int fast_serial_printf(const char * format, ...);
 
+// Redirect fast_serial_write on core 0 into buffer (up to buffer_size bytes)
+// instead of USB. Writes from core 1 still go to USB.
+void fast_serial_capture_start(char * buffer, uint32_t buffer_size);
+
+// Stop capturing. Returns the number of bytes captured, and whether more were
+// written than would fit
+uint32_t fast_serial_capture_end(bool * overflow);
+
+// Calculate a CRC-16/CCITT over buffer, continuing from crc (0xFFFF to start)
+uint16_t fast_serial_crc16(const void * buffer, uint32_t buffer_size, uint16_t crc);
+
 // Force write of data. Returns number of bytes written.
 static inline uint32_t fast_serial_write_flush(){
 	return tud_cdc_write_flush();
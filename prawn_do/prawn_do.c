@@ -3,43 +3,180 @@
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include "pico/bootrom.h"
 #include "pico/stdio.h"
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "pico/time.h"
 #include "hardware/dma.h"
+#include "hardware/flash.h"
 #include "hardware/clocks.h"
 #include "hardware/pio.h"
+#include "hardware/vreg.h"
+#include "hardware/structs/bus_ctrl.h"
 #include "hardware/structs/clocks.h"
+#include "hardware/structs/io_bank0.h"
+#include "hardware/structs/systick.h"
 
 
 #include "prawn_do.pio.h"
 #include "fast_serial.h"
 
 #define LED_PIN 25
-// output pins to use, must match pio
-#define OUTPUT_PIN_BASE 0
-#define OUTPUT_WIDTH 16
-// mask which bits we are using
-uint32_t output_mask = ((1 << OUTPUT_WIDTH) - 1) << OUTPUT_PIN_BASE;
+// System clock at boot (and after a resus), and the fastest the clk command
+// accepts. The overclocked build raises the core voltage to run out of spec.
+#ifdef PRAWNDO_OVERCLOCK
+#define DEFAULT_SYS_CLOCK_KHZ 200000
+#define MAX_SYS_CLOCK_HZ 250000000
+#define OVERCLOCK_VOLTAGE VREG_VOLTAGE_1_20
+#elif PRAWNDO_PICO_BOARD == 1
+#define DEFAULT_SYS_CLOCK_KHZ 100000
+#define MAX_SYS_CLOCK_HZ 133000000
+#elif PRAWNDO_PICO_BOARD == 2
+#define DEFAULT_SYS_CLOCK_KHZ 100000
+#define MAX_SYS_CLOCK_HZ 150000000
+#else
+#    error "Unsupported PICO_BOARD"
+#endif // PRAWNDO_OVERCLOCK
+// largest difference from the requested clock the boot self-test allows
+#define CLOCK_TOLERANCE_KHZ (DEFAULT_SYS_CLOCK_KHZ / 1000)
+// pin map, set per firmware in CMakeLists.txt (see prawn_do.pio.in)
+#define OUTPUT_PIN_BASE prawn_do_OUTPUT_PIN_BASE
+#define OUTPUT_WIDTH prawn_do_OUTPUT_WIDTH
+#define TRIGGER_PIN prawn_do_TRIGGER_PIN
+#define BRANCH_PIN_BASE prawn_do_BRANCH_PIN_BASE
+// external clock input (GPIN0)
+#define CLOCK_IN_PIN 20
+// the tag bits above the output word must hold any PIO address (see
+// wait_end in prawn_do.pio.in), and the core1 commands must fit above them
+_Static_assert(OUTPUT_WIDTH >= 1 && OUTPUT_WIDTH <= 27, "output width must be 1-27 pins");
+_Static_assert(OUTPUT_PIN_BASE + OUTPUT_WIDTH <= NUM_BANK0_GPIOS, "output pins do not exist");
+_Static_assert(TRIGGER_PIN < NUM_BANK0_GPIOS
+			   && BRANCH_PIN_BASE + prawn_do_NUM_BRANCH_PINS <= NUM_BANK0_GPIOS,
+			   "trigger or branch pins do not exist");
+#define IS_OUTPUT_PIN(pin) ((pin) >= OUTPUT_PIN_BASE && (pin) < OUTPUT_PIN_BASE + OUTPUT_WIDTH)
+#define IS_BRANCH_PIN(pin) ((pin) >= BRANCH_PIN_BASE && (pin) < BRANCH_PIN_BASE + prawn_do_NUM_BRANCH_PINS)
+_Static_assert(!IS_OUTPUT_PIN(TRIGGER_PIN) && !IS_OUTPUT_PIN(CLOCK_IN_PIN) && !IS_OUTPUT_PIN(LED_PIN)
+			   && !(OUTPUT_PIN_BASE < BRANCH_PIN_BASE + prawn_do_NUM_BRANCH_PINS
+					&& BRANCH_PIN_BASE < OUTPUT_PIN_BASE + OUTPUT_WIDTH)
+			   && !IS_BRANCH_PIN(TRIGGER_PIN) && !IS_BRANCH_PIN(CLOCK_IN_PIN) && !IS_BRANCH_PIN(LED_PIN)
+			   && TRIGGER_PIN != CLOCK_IN_PIN && TRIGGER_PIN != LED_PIN,
+			   "the output, trigger, branch, clock and LED pins overlap");
+// mask which pins we are using
+uint32_t output_mask = ((1u << OUTPUT_WIDTH) - 1) << OUTPUT_PIN_BASE;
+// bytes (and hex digits) of an output word in adm records (and dmp)
+#define OUTPUT_BYTES ((OUTPUT_WIDTH + 7) / 8)
+#define OUTPUT_HEX_DIGITS ((OUTPUT_WIDTH + 3) / 4)
 // command type enum
 enum COMMAND {
 	BUFFERED = 1 << OUTPUT_WIDTH,
 	HWSTART = 2 << OUTPUT_WIDTH,
 	BUFFERED_HWSTART = BUFFERED | HWSTART,
+	FLASH_LOCKOUT = 4 << OUTPUT_WIDTH, // park core1 in RAM while flash is written
+	DECODE = 8 << OUTPUT_WIDTH, // decode adm records from decode_ring
 	MANUAL = 0
 };
 
 // two DO CMDS per INSTRUCTION
-#define MAX_INSTR PRAWNDO_NUM_INSTRUCTIONS
+// The instruction capacity is whatever RAM is left free by the linker,
+// set up by init_do_cmds at boot (the build checks it is at least
+// num_instructions in CMakeLists.txt, see prawn_do_capacity.ld)
+uint32_t max_instr = 0;
+#define MAX_INSTR max_instr
 #define MAX_DO_CMDS (2*MAX_INSTR)
-uint32_t do_cmds[MAX_DO_CMDS];
+// largest block that can be replayed in periodic mode, must be a power of two
+#define MAX_PERIODIC_INSTR 512
+// do_cmds is aligned so any power-of-two block starting at a multiple of its
+// own length can be used as a DMA address ring
+uint32_t * do_cmds;
 uint32_t do_cmd_count = 0;
-
+// Timing index: timing_checkpoints[k] is the number of clock cycles before
+// instruction k*TIMING_STRIDE, valid for k < timing_checkpoints_valid. It is
+// extended as needed, and cut back to the lowest instruction modified.
+#define TIMING_STRIDE 256
+#define MAX_TIMING_CHECKPOINTS 256 // enough for all of the RP2350's SRAM
+// (plus one for the end of a full table, which instruction_at looks up)
+uint64_t timing_checkpoints[MAX_TIMING_CHECKPOINTS + 1] = {0};
+uint32_t timing_checkpoints_valid = 1; // there are no cycles before instruction 0
+// free RAM left to malloc after do_cmds is allocated
+#define HEAP_RESERVE PRAWNDO_HEAP_RESERVE
+// the build checks there is RAM for at least this many instructions
+#define MIN_INSTR PRAWNDO_MIN_INSTRUCTIONS
+// start and end of the free RAM after .bss (from the SDK linker script)
+extern char __end__;
+extern char __HeapLimit;
+// longest duration (in clock cycles) a single instruction can hold
+#define MAX_REPS 0xFFFFFFFFull
+
+// Wait modes, given by the host in place of reps. 0 is a plain indefinite
+// wait; any other mode takes its parameter from the following instruction.
+#define WAIT_PLAIN 0
+#define WAIT_RISING 1 // parameter: number of rising edges
+#define WAIT_FALLING 2 // parameter: number of falling edges
+#define WAIT_TIMEOUT 3 // parameter: timeout in clock cycles
+#define WAIT_BRANCH 4 // parameter: number of branch pins (output word), hold cycles
+#define NUM_WAIT_MODES 5
+// the wait modes take up every reps value below the shortest duration, so
+// any 32-bit reps is valid (as a wait mode or a duration)
+_Static_assert(NUM_WAIT_MODES == 5, "reps values between the wait modes and 5 would be invalid");
+// PIO routine implementing each wait mode. The instruction after a wait
+// carries this address above its output word (see wait_end in prawn_do.pio).
+const uint32_t __not_in_flash("tables") wait_targets[NUM_WAIT_MODES] = {
+	prawn_do_offset_level_wait,
+	prawn_do_offset_wait_rising,
+	prawn_do_offset_wait_falling,
+	prawn_do_offset_wait_timeout,
+	prawn_do_offset_branch
+};
+// smallest parameter each wait mode accepts
+const uint32_t __not_in_flash("tables") wait_param_min[NUM_WAIT_MODES] = {0, 1, 1, 2, 5};
+_Static_assert(prawn_do_offset_level_wait == 0, "plain waits rely on level_wait being at address 0");
+#define WAIT_TARGET_SHIFT OUTPUT_WIDTH
+#define OUTPUT_WORD_MASK ((1u << WAIT_TARGET_SHIFT) - 1)
+// Tag of the instructions following a branch parameter, one per combination
+// of the branch pins, each holding the instruction to continue from. They
+// are never sent to the PIO, so the tag only needs to avoid PIO addresses.
+#define BRANCH_TARGET_TAG (0xFFFFFFFFu >> WAIT_TARGET_SHIFT)
+// branch points in the sequence, by the address of their parameter
+#define MAX_BRANCHES 256
+uint32_t branch_params[MAX_BRANCHES];
+uint32_t branch_count = 0;
+unsigned short branch_index_valid = 0;
+
+
+// Saved sequences are kept in banks at the end of flash, each large enough
+// for a full instruction table. The first sector of a bank holds its header,
+// and the instructions follow from the next sector. The banks are set in
+// CMakeLists.txt, which also checks the firmware does not overlap them.
+#define NUM_SAVE_BANKS PRAWNDO_NUM_SAVE_BANKS
+#define SAVE_BANK_SIZE PRAWNDO_SAVE_BANK_SIZE
+#define SAVE_REGION_OFFSET (PICO_FLASH_SIZE_BYTES - NUM_SAVE_BANKS * SAVE_BANK_SIZE)
+#define SAVE_MAGIC 0x50524e44 // "PRND"
+// the layout of the instructions depends on the output width, so firmware
+// with another width does not load them (version 1 in the low byte, width above)
+#define SAVE_FORMAT (1 | (OUTPUT_WIDTH << 8))
+// what to do with a saved sequence at boot
+#define BOOT_NONE 0
+#define BOOT_LOAD 1
+#define BOOT_RUN 2 // load and arm for a hardware start
+struct save_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t do_cmd_count;
+	uint32_t crc; // CRC32 of the instructions, from the DMA sniffer
+	uint32_t periodic_start;
+	uint32_t periodic_count;
+	uint32_t periodic_trigger_stop;
+	uint32_t boot;
+};
+// set by core0 while core1 is parked for a flash write
+volatile uint32_t flash_lockout = 0;
 
 #define SERIAL_BUFFER_SIZE 256
-char serial_buf[SERIAL_BUFFER_SIZE];
+// Kept in a scratch bank (alongside core1's stack) so core0 parsing commands
+// does not contend with the DMA reading do_cmds from main SRAM
+char __scratch_x("serial_buf") serial_buf[SERIAL_BUFFER_SIZE];
 
 // STATUS flag
 int status;
@@ -54,14 +191,130 @@ int status;
 #define INTERNAL 0
 #define EXTERNAL 1
 int clk_status = INTERNAL;
+// External clock monitoring: while the external clock is in use, clk_sys is
+// counted against the crystal derived microsecond timer every
+// CLOCK_MONITOR_MS, and its drift from the requested frequency found over
+// CLOCK_MONITOR_WINDOW periods. After a resus, the reference is counted on
+// pin 20 each period (by core0's main loop, while it waits for a command)
+// until it has been back for CLOCK_RELOCK_PERIODS periods, and it is then
+// selected again (between runs).
+// SysTick only counts 2^24 cycles, so the period must be well under that
+// (67 ms at 250 MHz). A tick that comes later than that, as interrupts were
+// disabled, cannot be counted and starts a new window.
+#define CLOCK_MONITOR_MS 20
+#define CLOCK_MONITOR_WINDOW 50
+#define CLOCK_LOCK_PPM 200 // largest drift at which the clock counts as locked
+#define CLOCK_RELOCK_PERIODS 10
+struct repeating_timer clock_monitor_timer;
+uint32_t clock_ext_freq = 0; // requested external clock frequency (Hz)
+volatile unsigned short clock_lost = 0; // external clock replaced after a resus
+uint32_t clock_window_periods = 0;
+uint64_t clock_window_cycles = 0;
+uint64_t clock_window_start_us = 0;
+uint32_t clock_last_systick = 0;
+uint64_t clock_last_tick_us = 0; // when clock_last_systick was read
+uint32_t clock_relock_periods = 0;
+volatile unsigned short clock_relock_due = 0; // set by the monitor each period
+int32_t clock_drift_ppm = 0; // drift over the last full window
+int32_t max_clock_drift_ppm = 0; // largest (in magnitude) since clk was set
+unsigned short clock_locked = 0;
+uint32_t resus_count = 0;
+uint64_t last_resus_us = 0;
+uint32_t relock_count = 0;
+uint64_t last_relock_us = 0;
+// Set if the clock was lost or drifted out of lock during the current run
+volatile unsigned short run_clock_fault = 0;
+uint32_t last_run_clock_invalid = 0;
+uint32_t clock_invalid_run_count = 0;
+// clk_sys measured by the boot self-test, and whether it passed
+uint32_t boot_clock_khz = 0;
+unsigned short boot_clock_ok = 0;
+// clock restored after a resus: the default, unless it failed the self-test
+uint32_t resus_clock_khz = DEFAULT_SYS_CLOCK_KHZ;
 unsigned short debug = 0;
+// periodic mode: replay do_cmds[periodic_start, periodic_start+periodic_count)
+// until aborted (or triggered, if periodic_trigger_stop is set)
+uint32_t periodic_start = 0;
+uint32_t periodic_count = 0; // 0 disables periodic mode
+unsigned short periodic_trigger_stop = 0;
+// transfer count the reload channel writes back into the output DMA channel
+const uint32_t __not_in_flash("tables") periodic_reload = 0xFFFFFFFF;
+// Telemetry, updated by core1 at the end of each run
+uint32_t run_count = 0;
+uint32_t timeout_run_count = 0; // runs in which a timed wait fell through
+uint32_t last_run_timed_out = 0;
+uint32_t branch_taken_count = 0;
+uint32_t max_branch_cycles = 0; // worst case from branch pin sample to DMA restart
+// Core1 latency (in clock cycles, timed with SysTick): from the run command
+// to the state machine starting, from the end of a run being seen to the
+// state machine stopping, and the longest pass of the run loop, which bounds
+// how late an abort or the end of a run is seen
+uint32_t arm_cycles = 0;
+uint32_t min_arm_cycles = UINT32_MAX;
+uint32_t max_arm_cycles = 0;
+uint32_t stop_cycles = 0;
+uint32_t max_stop_cycles = 0;
+uint32_t max_poll_cycles = 0;
+// runs in which the PIO stalled waiting for the DMA (FDEBUG TXSTALL)
+uint32_t starved_run_count = 0;
+uint32_t last_run_starved = 0;
+// time taken by the most recent flash save and load (including at boot)
+uint32_t last_save_us = 0;
+uint32_t last_load_us = 0;
+// adm uploads are pipelined: core0 copies records from USB into decode_ring
+// and core1 decodes them into do_cmds. The ring holds whole records, so none
+// wraps around its end. decode_head and decode_tail count the bytes written
+// (by core0 only) and decoded (by core1 only).
+#define ADM_RECORD_SIZE (OUTPUT_BYTES + 4)
+#define DECODE_RING_SIZE (ADM_RECORD_SIZE * 512)
+char decode_ring[DECODE_RING_SIZE];
+volatile uint32_t decode_head = 0;
+volatile uint32_t decode_tail = 0;
+uint32_t decode_addr = 0; // first instruction of the upload
+uint32_t decode_count = 0; // number of instructions in the upload
+uint32_t decode_error_count = 0;
+uint32_t decode_last_error = 0;
+// Outputs driven by the sequence during a run, as bits of the output word.
+// The rest keep their manual state (see release_unowned_outputs).
+uint32_t run_output_mask = OUTPUT_WORD_MASK;
+// The GPIO pins of the outputs not in run_output_mask, worked out when it is
+// set so arming a run only touches those pins
+uint32_t unowned_pin_mask = 0;
+uint8_t unowned_pins[OUTPUT_WIDTH];
+uint32_t unowned_pin_count = 0;
+// Benchmark counters, reported and reset by bch. Cycles are counted by
+// core0's SysTick timer.
+uint32_t bench_commands = 0;
+uint64_t bench_start_us = 0;
+uint32_t bench_lines = 0; // text command lines (the rest are framed)
+uint64_t bench_read_cycles = 0; // receiving text command lines (after the first byte)
+uint64_t bench_handler_cycles = 0; // running commands, including their responses
+uint64_t bench_write_cycles = 0; // in fast_serial_write, while running commands
+uint32_t bench_adm_bytes = 0; // most recent adm upload, until decoded
+uint32_t bench_adm_us = 0;
+// number of times bch times sscanf parsing a fixed command line (a synthetic
+// micro-benchmark, not a measurement of the commands received)
+#define BENCH_SSCANF_REPS 256
+
+// PIO state machine and DMA channel core1 runs sequences with, so core0 can
+// work out how far through a run it is
+PIO run_pio;
+uint run_sm = 0;
+uint run_dma_chan = 0;
+// number of instructions replayed by the stress test, must be a valid
+// periodic block
+#define STRESS_INSTR MAX_PERIODIC_INSTR
+// normalise the instruction table after add/adm
+unsigned short auto_normalise = 0;
+// instructions saved by the most recent normalisation pass
+uint32_t normalise_saved = 0;
 const char ver[6] = "1.3.1";
 
 // Mutex for status
 static mutex_t status_mutex;
 
 // Thread safe functions for getting/setting status
-int get_status()
+int __not_in_flash_func(get_status)()
 {
 	mutex_enter_blocking(&status_mutex);
 	int status_copy = status;
@@ -69,7 +322,7 @@ int get_status()
 	return status_copy;
 }
 
-void set_status(int new_status)
+void __not_in_flash_func(set_status)(int new_status)
 {
 	mutex_enter_blocking(&status_mutex);
 	status = new_status;
@@ -87,18 +340,38 @@ void set_status(int new_status)
   This function is inspired by the logic_analyser_arm function on page 46
   of the Raspberry Pi Pico C/C++ SDK manual (except for output, rather than 
   input).
+
+  A hardware start begins at the wait instruction just before the main loop,
+  a software start jumps straight into the main loop.
+
+  In periodic mode the DMA read address is wrapped around the periodic block
+  (a power of two number of bytes, aligned to its size) so the block is
+  replayed with no CPU involvement. The wrap only applies to the address,
+  so reload_chan is chained to re-arm the transfer count each time the
+  2^32 - 1 word count runs out.
+
+  Otherwise the DMA sends the first words of do_cmds, which is the whole
+  sequence, or up to its first branch point.
  */
-void start_sm(PIO pio, uint sm, uint dma_chan, uint offset, uint hwstart){
+void __not_in_flash_func(start_sm)(PIO pio, uint sm, uint dma_chan, uint reload_chan, uint offset, uint hwstart, uint32_t words){
 	pio_sm_set_enabled(pio, sm, false);
 
 	// Clearing the FIFOs and restarting the state machine to prevent old
 	// instructions from persisting into future runs
 	pio_sm_clear_fifos(pio, sm);
 	pio_sm_restart(pio, sm);
-	// send initial wait command (preceeds DMA transfer)
-	pio_sm_put_blocking(pio, sm, hwstart);
-	// Explicitly jump to reset program to the start
-	pio_sm_exec(pio, sm, pio_encode_jmp(offset));
+	// Clear the end of program and timed wait flags left by a previous run
+	pio_interrupt_clear(pio, sm);
+	pio_interrupt_clear(pio, 4 + sm);
+	// Clear the stall flag, which is set if the TX FIFO ever runs dry
+	pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + sm);
+	// Explicitly jump to the hardware or software start of the program
+	if(hwstart){
+		pio_sm_exec(pio, sm, pio_encode_jmp(offset + prawn_do_offset_start));
+	}
+	else{
+		pio_sm_exec(pio, sm, pio_encode_jmp(offset + prawn_do_offset_new_output));
+	}
 
 	// Create dma configuration object
 	dma_channel_config dma_config = dma_channel_get_default_config(dma_chan);
@@ -108,616 +381,2255 @@ void start_sm(PIO pio, uint sm, uint dma_chan, uint offset, uint hwstart){
 	channel_config_set_write_increment(&dma_config, false);
 	// Set data transfer request signal to the one pio uses
 	channel_config_set_dreq(&dma_config, pio_get_dreq(pio, sm, true));
-	// Start dma with the selected channel, generated config
-	dma_channel_configure(dma_chan, &dma_config,
-						  &pio->txf[sm], // write address is fifo for this pio 
-										 // and state machine
-						  do_cmds, // read address is do_cmds
-						  do_cmd_count, // read a total of do_cmd_count entries
-						  true); // trigger (start) immediately
+	if(periodic_count > 0){
+		// Wrap reads within the block (8 bytes per instruction)
+		channel_config_set_ring(&dma_config, false, __builtin_ctz(8 * periodic_count));
+		channel_config_set_chain_to(&dma_config, reload_chan);
+
+		dma_channel_config reload_config = dma_channel_get_default_config(reload_chan);
+		channel_config_set_read_increment(&reload_config, false);
+		channel_config_set_write_increment(&reload_config, false);
+		dma_channel_configure(reload_chan, &reload_config,
+							  &dma_hw->ch[dma_chan].al1_transfer_count_trig,
+							  &periodic_reload,
+							  1,
+							  false);
+
+		dma_channel_configure(dma_chan, &dma_config,
+							  &pio->txf[sm],
+							  &do_cmds[2*periodic_start],
+							  periodic_reload,
+							  true);
+	}
+	else{
+		// Start dma with the selected channel, generated config
+		dma_channel_configure(dma_chan, &dma_config,
+							  &pio->txf[sm], // write address is fifo for this pio 
+											 // and state machine
+							  do_cmds, // read address is do_cmds
+							  words, // read a total of words entries
+							  true); // trigger (start) immediately
+	}
 
 	// Actually start state machine
 	pio_sm_set_enabled(pio, sm, true);
 }
+/*
+  Hand the outputs the run does not own from the PIO to the SIO before the
+  state machine starts, so they hold their current level whatever the
+  sequence outputs. The SIO is set to drive the same level before the pin
+  function is switched, so the hand-off cannot glitch, and the PIO needs
+  no extra work while running.
+ */
+void __not_in_flash_func(release_unowned_outputs)(){
+	uint32_t pins = unowned_pin_mask;
+	if(pins == 0){
+		return;
+	}
+	gpio_put_masked(pins, gpio_get_all());
+	gpio_set_dir_out_masked(pins);
+	for(uint32_t i = 0; i < unowned_pin_count; i++){
+		hw_write_masked(&io_bank0_hw->io[unowned_pins[i]].ctrl,
+						GPIO_FUNC_SIO << IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB,
+						IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS);
+	}
+}
+
+/*
+  Give the outputs released for a run back to the PIO once it has stopped,
+  setting the PIO's outputs to their levels first (the sequence has
+  overwritten them)
+ */
+void reclaim_unowned_outputs(PIO pio, uint sm){
+	uint32_t pins = unowned_pin_mask;
+	if(pins == 0){
+		return;
+	}
+	pio_sm_set_pins_with_mask(pio, sm, gpio_get_all(), pins);
+	for(uint32_t i = 0; i < unowned_pin_count; i++){
+		hw_write_masked(&io_bank0_hw->io[unowned_pins[i]].ctrl,
+						pio_get_funcsel(pio) << IO_BANK0_GPIO0_CTRL_FUNCSEL_LSB,
+						IO_BANK0_GPIO0_CTRL_FUNCSEL_BITS);
+	}
+	gpio_set_dir_in_masked(pins);
+}
+
 /*
   Stop pio state machine
 
   This function stops dma, stops the pio state machine,
   and clears the transfer fifos of the state machine.
  */
-void stop_sm(PIO pio, uint sm, uint dma_chan){
+void __not_in_flash_func(stop_sm)(PIO pio, uint sm, uint dma_chan, uint reload_chan){
+	// stop the reload channel first so it cannot re-arm the output channel
+	dma_channel_abort(reload_chan);
 	dma_channel_abort(dma_chan);
+	dma_channel_abort(reload_chan);
 	pio_sm_set_enabled(pio, sm, false);
 	pio_sm_clear_fifos(pio, sm);
 }
 
-/* Measure system frequencies
-From https://github.com/raspberrypi/pico-examples under BSD-3-Clause License
-*/
-void measure_freqs(void)
-{
-    uint f_pll_sys = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_PLL_SYS_CLKSRC_PRIMARY);
-    uint f_pll_usb = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_PLL_USB_CLKSRC_PRIMARY);
-    uint f_rosc = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_ROSC_CLKSRC);
-    uint f_clk_sys = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS);
-    uint f_clk_peri = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_PERI);
-    uint f_clk_usb = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_USB);
-    uint f_clk_adc = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_ADC);
-#ifdef CLOCKS_FC0_SRC_VALUE_CLK_RTC
-    uint f_clk_rtc = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_RTC);
-#endif
-
-    fast_serial_printf("pll_sys = %dkHz\r\n", f_pll_sys);
-    fast_serial_printf("pll_usb = %dkHz\r\n", f_pll_usb);
-    fast_serial_printf("rosc = %dkHz\r\n", f_rosc);
-    fast_serial_printf("clk_sys = %dkHz\r\n", f_clk_sys);
-    fast_serial_printf("clk_peri = %dkHz\r\n", f_clk_peri);
-    fast_serial_printf("clk_usb = %dkHz\r\n", f_clk_usb);
-    fast_serial_printf("clk_adc = %dkHz\r\n", f_clk_adc);
-#ifdef CLOCKS_FC0_SRC_VALUE_CLK_RTC
-    fast_serial_printf("clk_rtc = %dkHz\r\n", f_clk_rtc);
-#endif
+/*
+  Set the bits above the output word of the instruction at addr. Only
+  those bits are touched, so retagging never disturbs an instruction
+  already stored there.
+ */
+void __not_in_flash_func(tag_instruction)(uint32_t addr, uint32_t tag){
+	if(addr < MAX_INSTR){
+		do_cmds[2*addr] = (do_cmds[2*addr] & OUTPUT_WORD_MASK)
+			| (tag << WAIT_TARGET_SHIFT);
+	}
+	// any change to the tags may add, move or remove a branch
+	branch_index_valid = 0;
 }
 
-/* Resusitation function that restarts the clock internally if there are any 
-   issues with syncing the external clock or invalid changes to the clock
-*/
-void clk_resus(void) {
-	// Restarting the internal clock at 100 MHz (set in kHz)
-	set_sys_clock_khz(100000, false);
-
-	// Remove the clock syncing functionality
-	gpio_set_function(20, GPIO_FUNC_NULL);
+/*
+  Tag the instruction at addr with the PIO routine for the wait mode of the
+  instruction before it.
+ */
+void __not_in_flash_func(tag_wait_param)(uint32_t addr, uint32_t mode){
+	tag_instruction(addr, wait_targets[mode]);
+}
 
-	clk_status = INTERNAL;
+// Invalidate timing checkpoints after the instruction at addr
+void __not_in_flash_func(invalidate_timing)(uint32_t addr){
+	if(addr / TIMING_STRIDE + 1 < timing_checkpoints_valid){
+		timing_checkpoints_valid = addr / TIMING_STRIDE + 1;
+	}
+}
 
-	// Restart the serial communication
-	stdio_init_all();
+// Check whether the instruction at addr is a branch target entry
+int __not_in_flash_func(is_branch_target)(uint32_t addr){
+	return addr < MAX_INSTR
+		&& (do_cmds[2*addr] >> WAIT_TARGET_SHIFT) == BRANCH_TARGET_TAG;
+}
 
-	// Notify the user that the system clock has been restarted
-	fast_serial_printf("System Clock Resus'd\r\n");
+/*
+  Get the mode of the wait that the instruction at addr is the parameter of,
+  or WAIT_PLAIN if it is not a wait parameter.
+ */
+uint32_t __not_in_flash_func(wait_param_mode)(uint32_t addr){
+	if(addr == 0 || addr >= MAX_INSTR || do_cmds[2*addr - 1] != 0){
+		return WAIT_PLAIN;
+	}
+	uint32_t target = do_cmds[2*addr] >> WAIT_TARGET_SHIFT;
+	for(uint32_t mode = 1; mode < NUM_WAIT_MODES; mode++){
+		if(wait_targets[mode] == target){
+			return mode;
+		}
+	}
+	return WAIT_PLAIN;
 }
 
+/*
+  Convert a wait mode parameter from the host into the value the PIO routine
+  counts down. Returns 0 if the parameter is out of range.
+ */
+int __not_in_flash_func(encode_wait_param)(uint32_t mode, uint32_t param, uint32_t * x){
+	switch(mode){
+	case WAIT_RISING:
+	case WAIT_FALLING:
+		// loop runs X+1 times, once per edge
+		*x = param - 1;
+		break;
+	case WAIT_TIMEOUT:
+		// polling loop takes 2 cycles per iteration and runs X+1 times
+		*x = param / 2 - 1;
+		break;
+	case WAIT_BRANCH:
+		// next output is set X+4 cycles after the pins are sampled
+		*x = param - 4;
+		break;
+	default:
+		return 0;
+	}
+	return param >= wait_param_min[mode];
+}
 
+// Inverse of encode_wait_param
+uint32_t decode_wait_param(uint32_t mode, uint32_t x){
+	switch(mode){
+	case WAIT_TIMEOUT:
+		return 2 * (x + 1);
+	case WAIT_BRANCH:
+		return x + 4;
+	default:
+		return x + 1;
+	}
+}
 
-void core1_entry() {
-	// Setup PIO
-	PIO pio = pio0;
-	uint sm = pio_claim_unused_sm(pio, true);
-	uint dma_chan = dma_claim_unused_channel(true);
-	uint offset = pio_add_program(pio, &prawn_do_program); // load prawn_do PIO 
-														   // program
+/*
+  Store the parameter of the wait before addr. The output word of a
+  parameter instruction is not driven onto the pins.
+ */
+void __not_in_flash_func(store_wait_param)(uint32_t addr, uint32_t mode, uint32_t output, uint32_t x){
+	invalidate_timing(addr);
+	do_cmds[2*addr] = (output & OUTPUT_WORD_MASK) | (wait_targets[mode] << WAIT_TARGET_SHIFT);
+	do_cmds[2*addr + 1] = x;
+	tag_wait_param(addr + 1, WAIT_PLAIN);
+}
 
-	// initialize prawn_do PIO program on chosen PIO and state machine at 
-	// required offset
-	pio_sm_config pio_config = prawn_do_program_init(pio, sm, offset);
+/*
+  Store the parameter of the branch point before addr. The output word holds
+  the number of branch pins to sample, n, and the 2^n instructions after it
+  are tagged as the targets to continue from, indexed by the pin values.
+  Target tags left beyond them by a branch with more pins are removed.
+ */
+void __not_in_flash_func(store_branch_param)(uint32_t addr, uint32_t num_pins, uint32_t x){
+	store_wait_param(addr, WAIT_BRANCH, num_pins, x);
+	uint32_t num_targets = 1u << num_pins;
+	for(uint32_t i = 1; i <= num_targets; i++){
+		tag_instruction(addr + i, BRANCH_TARGET_TAG);
+	}
+	tag_wait_param(addr + num_targets + 1, WAIT_PLAIN);
+	for(uint32_t i = num_targets + 2; i <= (1u << prawn_do_NUM_BRANCH_PINS); i++){
+		if(is_branch_target(addr + i)){
+			tag_instruction(addr + i, 0);
+		}
+	}
+}
 
-	// signal core1 ready for commands
-	multicore_fifo_push_blocking(0);
+/*
+  Store a branch target entry at addr. The output word is kept for the
+  host to read back but never driven; reps is the instruction to continue
+  from. The next instruction is left alone as it may be another target.
+ */
+void __not_in_flash_func(store_branch_target)(uint32_t addr, uint32_t output, uint32_t target){
+	invalidate_timing(addr);
+	do_cmds[2*addr] = (output & OUTPUT_WORD_MASK) | (BRANCH_TARGET_TAG << WAIT_TARGET_SHIFT);
+	do_cmds[2*addr + 1] = target;
+	branch_index_valid = 0;
+}
 
-	while(1){
-		// wait for message from main core
-		uint32_t command = multicore_fifo_pop_blocking();
+/*
+  Store a wait (reps of 0) at addr and tag the next instruction so it is
+  recognised as the parameter of the wait, if the mode takes one.
+ */
+void __not_in_flash_func(store_wait)(uint32_t addr, uint32_t output, uint32_t mode){
+	invalidate_timing(addr);
+	do_cmds[2*addr] = output;
+	do_cmds[2*addr + 1] = 0;
+	tag_wait_param(addr + 1, mode);
+}
 
-		if(command & BUFFERED){
-			// buffered execution
-			uint32_t hwstart = !!(command & HWSTART);
+/*
+  Store an instruction at addr, splitting durations that do not fit in
+  32 bits into chained instructions holding the same output word.
 
-			set_status(TRANSITION_TO_RUNNING);
-			if(debug){
-				fast_serial_printf("hwstart: %d\r\n", hwstart);
+  Returns the number of instructions written, or 0 if they do not fit
+  in do_cmds.
+ */
+uint32_t __not_in_flash_func(store_chained)(uint32_t addr, uint32_t output, uint64_t reps){
+	invalidate_timing(addr);
+	uint32_t count = 0;
+	do {
+		if(addr + count >= MAX_INSTR){
+			return 0;
+		}
+		uint64_t chunk = reps;
+		if(chunk > MAX_REPS){
+			chunk = MAX_REPS;
+			// never leave a remainder shorter than the minimum pulse
+			if(reps - chunk < 5){
+				chunk = reps - 5;
 			}
-			// start the state machine
-			start_sm(pio, sm, dma_chan, offset, hwstart);
-			set_status(RUNNING);
+		}
+		do_cmds[2*(addr + count)] = output;
+		// Adjust from the number of 10ns reps 
+		// to reps adding onto the base 50 ns pulse width
+		do_cmds[2*(addr + count) + 1] = chunk != 0 ? (uint32_t) (chunk - 4) : 0;
+		reps -= chunk;
+		count++;
+	} while(reps > 0);
+	tag_wait_param(addr + count, WAIT_PLAIN);
+	return count;
+}
 
-			// can save IRQ PIO instruction by using the following check instead
-			//while ((dma_channel_is_busy(dma_chan) // checks if dma finished
-			//        || pio_sm_is_tx_fifo_empty(pio, sm)) // ensure fifo is empty once dma finishes
-			//	     && get_status() != ABORT_REQUESTED) // breaks if Abort requested
-			while (!pio_interrupt_get(pio, sm) // breaks if PIO program reaches end
-				&& get_status() != ABORT_REQUESTED // breaks if Abort requested
-				){
-				// tight loop checking for run completion
-				// exits if program signals IRQ (at end) or abort requested
-				continue;
-			}
-			// ensure interrupt is cleared
-			pio_interrupt_clear(pio, sm);
+/*
+  Decode one instruction received from the host and store it at addr
 
-			if(debug){
-				fast_serial_printf("Tight execution loop ended\r\n");
-				uint8_t pc = pio_sm_get_pc(pio, sm);
-				fast_serial_printf("Program ended at instr %d\r\n", pc-offset);
-			}
+  reps of 0 is a plain wait, 1 to NUM_WAIT_MODES-1 selects a wait mode and
+  anything larger is a duration, unless the instruction before is a wait
+  with a mode, when this instruction is its parameter. Branch target
+  entries store reps as the target unchanged. Invalid parameters are
+  replaced with their minimum so a block upload can carry on.
 
-			if(get_status() == ABORT_REQUESTED){
-				set_status(ABORTING);
-				stop_sm(pio, sm, dma_chan);
-				set_status(ABORTED);
-				if(debug){
-					fast_serial_printf("Aborted execution\r\n");
-				}
-			}
-			else{
-				set_status(TRANSITION_TO_STOP);
-				stop_sm(pio, sm, dma_chan);
-				set_status(STOPPED);
-				if(debug){
-					fast_serial_printf("Execution stopped\r\n");
-				}
-			}
-			if(debug){
-				fast_serial_printf("Core1 loop ended\r\n");
+  Returns 1 if the instruction was valid, 0 otherwise.
+ */
+int __not_in_flash_func(decode_instruction)(uint32_t addr, uint32_t output, uint32_t reps){
+	if(is_branch_target(addr)){
+		store_branch_target(addr, output, reps);
+		return 1;
+	}
+	uint32_t mode = wait_param_mode(addr);
+	if(mode != WAIT_PLAIN){
+		uint32_t x;
+		int valid = encode_wait_param(mode, reps, &x);
+		if(!valid){
+			encode_wait_param(mode, wait_param_min[mode], &x);
+		}
+		if(mode == WAIT_BRANCH){
+			if(output == 0 || output > prawn_do_NUM_BRANCH_PINS){
+				output = 1;
+				valid = 0;
 			}
+			store_branch_param(addr, output, x);
 		}
 		else{
-			// manual update
-			uint32_t manual_state = command;
-			pio_sm_set_pins_with_mask(pio, sm, manual_state, output_mask);
-			if(debug){
-				fast_serial_printf("Output commanded: %x\r\n", manual_state);
-			}
-			
+			store_wait_param(addr, mode, output, x);
 		}
+		return valid;
 	}
+	if(reps < NUM_WAIT_MODES){
+		store_wait(addr, output, reps);
+		return 1;
+	}
+	store_chained(addr, output, reps);
+	return 1;
 }
-int main(){
-
-	// initialize status mutex
-	mutex_init(&status_mutex);
-	
-	// Setup serial
-	fast_serial_init();
 
-	// By default, set the system clock to 100 MHz
-	set_sys_clock_khz(100000, false);
-
-	// Allow the clock to be restarted in case of any errors
-	clocks_enable_resus(&clk_resus);
+/*
+  Read back the instruction at addr as the host would have sent it
+ */
+void read_instruction(uint32_t addr, uint32_t * output, uint32_t * reps){
+	uint32_t mode = wait_param_mode(addr);
+	*output = do_cmds[2*addr] & OUTPUT_WORD_MASK;
+	*reps = do_cmds[2*addr + 1];
+	if(is_branch_target(addr)){
+		// targets are reported as stored
+		return;
+	}
+	if(mode != WAIT_PLAIN){
+		*reps = decode_wait_param(mode, *reps);
+	}
+	else if(*reps == 0){
+		// report the mode of a wait in place of its reps
+		*reps = wait_param_mode(addr + 1);
+	}
+	else{
+		*reps += 4;
+	}
+}
 
-	// Turn on onboard LED (to indicate device is starting)
-	gpio_init(LED_PIN);
-	gpio_set_dir(LED_PIN, GPIO_OUT);
-	gpio_put(LED_PIN, 1);
+/*
+  Decode a buffer of binary instructions (as sent with adm) into do_cmds
+  starting at addr. Each instruction is ADM_RECORD_SIZE bytes: the output
+  word (OUTPUT_BYTES bytes, 2 for 16 outputs) followed by 32 bit reps, both
+  little endian.
 
-	// Finish startup
-	fast_serial_printf("Prawn Digital Output online\r\n");
-	gpio_put(LED_PIN, 0);
+  Returns the number of invalid instructions, and the (1 indexed) position
+  of the last of them in last_error.
+ */
+uint32_t __not_in_flash_func(decode_binary_instructions)(const char * buf, uint32_t addr, uint32_t count, uint32_t * last_error){
+	uint32_t error_count = 0;
+	for(uint32_t i = 0; i < count; i++){
+		const char * record = &buf[ADM_RECORD_SIZE*i];
+		uint32_t output = 0;
+		for(uint32_t b = 0; b < OUTPUT_BYTES; b++){
+			output |= (uint32_t) record[b] << (8*b);
+		}
+		uint32_t reps = ((record[OUTPUT_BYTES+3] << 24)
+						 | (record[OUTPUT_BYTES+2] << 16)
+						 | (record[OUTPUT_BYTES+1] << 8)
+						 | record[OUTPUT_BYTES]);
+		if(!decode_instruction(addr + i, output, reps)){
+			error_count++;
+			*last_error = addr + i + 1;
+		}
+	}
+	return error_count;
+}
 
-	multicore_launch_core1(core1_entry);
-    multicore_fifo_pop_blocking();
+/*
+  Check the periodic block can be replayed by the DMA address ring
 
-	// Set status to off
-	set_status(STOPPED);
+  The block must be a power of two long (at most MAX_PERIODIC_INSTR), start
+  at a multiple of its own length, lie within the programmed sequence and
+  contain no waits or stops.
+ */
+int periodic_block_valid(){
+	if(periodic_count == 0
+	   || periodic_count > MAX_PERIODIC_INSTR
+	   || (periodic_count & (periodic_count - 1)) != 0
+	   || periodic_start % periodic_count != 0
+	   || 2*(periodic_start + periodic_count) > do_cmd_count
+	   || wait_param_mode(periodic_start) != WAIT_PLAIN
+	   || is_branch_target(periodic_start)){
+		return 0;
+	}
+	for(uint32_t i = periodic_start; i < periodic_start + periodic_count; i++){
+		if(do_cmds[2*i + 1] == 0){
+			return 0;
+		}
+	}
+	return 1;
+}
 
+// Check whether the programmed sequence contains any branch points
+int has_branches(){
+	for(uint32_t addr = 1; addr < do_cmd_count / 2; addr++){
+		if(wait_param_mode(addr) == WAIT_BRANCH){
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	while(1){
-		
-		// Prompt for user command
-		// PIO runs independently, so CPU spends most of its time waiting here
-		gpio_put(LED_PIN, 1); // turn on LED while waiting for user
-		unsigned int buf_len = fast_serial_read_until(serial_buf, SERIAL_BUFFER_SIZE, '\n');
-		gpio_put(LED_PIN, 0);
-		int local_status = get_status();
+/*
+  Build the index of branch points that core1 uses to split the sequence
+  into DMA segments, checking each branch has all its targets and that
+  they point at instructions the PIO can start from.
 
-		// Check for command validity, all are at least three characters long
-		if(buf_len < 3){
-			fast_serial_printf("Invalid command: %s\r\n", serial_buf);
+  Returns 1 if the sequence is valid, otherwise prints why and returns 0.
+ */
+int index_branches(){
+	uint32_t num_instr = do_cmd_count / 2;
+	branch_count = 0;
+	for(uint32_t addr = 1; addr < num_instr; addr++){
+		if(wait_param_mode(addr) != WAIT_BRANCH){
 			continue;
 		}
-
-		// // These commands are allowed during buffered execution
-		if(strncmp(serial_buf, "ver", 3) == 0) {
-			fast_serial_printf("Version: %s\r\n", ver);
+		uint32_t num_pins = do_cmds[2*addr] & OUTPUT_WORD_MASK;
+		if(num_pins == 0 || num_pins > prawn_do_NUM_BRANCH_PINS){
+			fast_serial_printf("Invalid number of branch pins at instruction %x\r\n", addr);
+			return 0;
 		}
-		else if(strncmp(serial_buf, "brd", 3) == 0) {
-			fast_serial_printf("board: pico%d\r\n", PRAWNDO_PICO_BOARD);
+		uint32_t num_targets = 1u << num_pins;
+		if(addr + num_targets >= num_instr){
+			fast_serial_printf("Branch at instruction %x is missing targets\r\n", addr - 1);
+			return 0;
 		}
-		// Status command: return running status
-		else if(strncmp(serial_buf, "sts", 3) == 0){
-			fast_serial_printf("run-status:%d clock-status:%d\r\n", local_status, clk_status);
+		for(uint32_t i = 1; i <= num_targets; i++){
+			uint32_t target = do_cmds[2*(addr + i) + 1];
+			if(!is_branch_target(addr + i)
+			   || target >= num_instr
+			   || is_branch_target(target)
+			   || wait_param_mode(target) != WAIT_PLAIN){
+				fast_serial_printf("Invalid branch target %x at instruction %x\r\n", target, addr + i);
+				return 0;
+			}
 		}
-		// Enable debug mode
-		else if (strncmp(serial_buf, "deb", 3) == 0) {
-			debug = 1;
-			fast_serial_printf("ok\r\n");
+		if(branch_count == MAX_BRANCHES){
+			fast_serial_printf("Too many branch points (%d)\r\n", MAX_BRANCHES);
+			return 0;
 		}
-		// Disable debug mode
-		else if (strncmp(serial_buf, "ndb", 3) == 0) {
-			debug = 0;
-			fast_serial_printf("ok\r\n");
+		branch_params[branch_count++] = addr;
+	}
+	branch_index_valid = 1;
+	return 1;
+}
+
+/*
+  Find the first branch point at or after the instruction at addr.
+
+  Returns its position in branch_params, or branch_count if there is none.
+ */
+uint32_t __not_in_flash_func(next_branch)(uint32_t addr){
+	uint32_t lo = 0;
+	uint32_t hi = branch_count;
+	while(lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if(branch_params[mid] <= addr){
+			lo = mid + 1;
 		}
-		// Abort command: stop run by stopping state machine
-		else if(strncmp(serial_buf, "abt", 3) == 0){
-			if(local_status == RUNNING || local_status == TRANSITION_TO_RUNNING){
-				set_status(ABORT_REQUESTED);
-				fast_serial_printf("ok\r\n");
-			}
-			else {
-				fast_serial_printf("Can only abort when status is 1 or 2\r\n");
-			}
+		else{
+			hi = mid;
 		}
+	}
+	return lo;
+}
 
-		// // These commands can only happen in manual mode
-		else if (local_status != ABORTED && local_status != STOPPED){
-			fast_serial_printf("Cannot execute command %s during buffered execution.\r\n", serial_buf);
+/*
+  Number of do_cmds words the DMA sends for the segment starting at addr,
+  ending with the parameter of branch b (or the end of the sequence).
+ */
+uint32_t __not_in_flash_func(segment_words)(uint32_t addr, uint32_t b){
+	if(b < branch_count){
+		return 2 * (branch_params[b] + 1 - addr);
+	}
+	return do_cmd_count - 2 * addr;
+}
+
+/*
+  Checks made on core0 before a buffered run is handed to core1
+
+  Returns 1 if the run can start, otherwise prints why and returns 0.
+ */
+int prepare_run(){
+	if(periodic_count > 0 && !periodic_block_valid()){
+		fast_serial_printf("Invalid periodic block\r\n");
+		return 0;
+	}
+	if(!branch_index_valid && !index_branches()){
+		return 0;
+	}
+	return 1;
+}
+
+/*
+  Set the length of the sequence (in do_cmds entries). The tags of any
+  instructions cut off the end are cleared, so a later set or adm that
+  extends the sequence over them cannot pick up a stale wait parameter or
+  branch target tag it never wrote.
+ */
+void set_do_cmd_count(uint32_t count){
+	for(uint32_t i = count; i < do_cmd_count; i += 2){
+		do_cmds[i] &= OUTPUT_WORD_MASK;
+	}
+	do_cmd_count = count;
+}
+
+/*
+  Normalise the programmed sequence
+
+  Adjacent instructions driving the same output word are merged into one
+  duration, which is then re-split into as few chained instructions as
+  will hold it. Waits, stops and wait parameters are copied through
+  unchanged, so whatever follows a wait stays directly after it.
+  The table is rewritten in place, which is safe because a merged run
+  never needs more slots than it started with. Sequences with branches
+  are left alone, as moving instructions would invalidate their targets.
+
+  Returns the number of instruction slots saved.
+ */
+uint32_t normalise_instructions(){
+	if(has_branches()){
+		return 0;
+	}
+	invalidate_timing(0);
+	uint32_t num_instr = do_cmd_count / 2;
+	uint32_t read = 0;
+	uint32_t write = 0;
+	while(read < num_instr){
+		uint32_t output = do_cmds[2*read];
+		// a wait parameter has a routine address above its output word,
+		// so it never matches (and is never merged with) its neighbours
+		if(do_cmds[2*read + 1] == 0 || (output >> WAIT_TARGET_SHIFT) != 0){
+			do_cmds[2*write] = output;
+			do_cmds[2*write + 1] = do_cmds[2*read + 1];
+			read++;
+			write++;
+			continue;
 		}
-		
-		// Clear command: empty the buffered outputs
-		else if(strncmp(serial_buf, "cls", 3) == 0){
-			do_cmd_count = 0;
-			fast_serial_printf("ok\r\n");
+		uint64_t total = 0;
+		while(read < num_instr && do_cmds[2*read] == output
+			  && do_cmds[2*read + 1] != 0){
+			total += (uint64_t) do_cmds[2*read + 1] + 4;
+			read++;
+		}
+		write += store_chained(write, output, total);
+	}
+	set_do_cmd_count(2 * write);
+	return num_instr - write;
+}
+
+/*
+  Allocate do_cmds from the free RAM between the end of .bss and the top of
+  main SRAM, leaving HEAP_RESERVE bytes for anything else that uses malloc.
+  Allocating through malloc (rather than just using the addresses) means
+  later allocations can never overlap it. The firmware is built with
+  PICO_MALLOC_PANIC=0, so a request malloc cannot meet returns NULL and is
+  retried a little smaller.
+
+  do_cmds shares striped main SRAM with .data, .bss (which includes
+  TinyUSB's CDC FIFOs) and the heap. On the RP2040, the non-striped
+  alias of SRAM0-3 could give it banks of its own, but only by moving the
+  rest of the image out of the striped alias too. With the image in two
+  banks, the other two (128 kB, 16384 instructions) would hold fewer than
+  the RP2040 minimum of 30000, so the DMA is given bus priority instead
+  (see main).
+ */
+void init_do_cmds(void){
+	uint32_t align = 8 * MAX_PERIODIC_INSTR;
+	uint32_t free_bytes = &__HeapLimit - &__end__;
+	uint32_t bytes = free_bytes - HEAP_RESERVE;
+	// smallest table (with its alignment) the build promises
+	uint32_t min_bytes = 8 * MIN_INSTR + align;
+	char * block = malloc(bytes);
+	// retry a little smaller if malloc's bookkeeping does not fit
+	while(block == NULL && bytes >= min_bytes + align){
+		bytes -= align;
+		block = malloc(bytes);
+	}
+	if(block == NULL){
+		panic("Cannot allocate %d bytes for the instruction table", bytes);
+	}
+	uintptr_t start = ((uintptr_t) block + align - 1) & ~(uintptr_t) (align - 1);
+	do_cmds = (uint32_t *) start;
+	max_instr = (bytes - (start - (uintptr_t) block)) / 8;
+	// no instruction past the end of the sequence may carry a tag (see
+	// set_do_cmd_count)
+	memset(do_cmds, 0, 8 * max_instr);
+	if(max_instr > MAX_TIMING_CHECKPOINTS * TIMING_STRIDE){
+		max_instr = MAX_TIMING_CHECKPOINTS * TIMING_STRIDE;
+	}
+}
+
+/*
+  DMA words from src to dst, and return their CRC32 as calculated by the
+  DMA sniffer on the way. With write_increment false, every word is written
+  to dst, which just calculates the CRC.
+ */
+uint32_t dma_copy_crc(volatile void * dst, const volatile void * src, uint32_t words, bool write_increment){
+	uint chan = dma_claim_unused_channel(true);
+	dma_channel_config config = dma_channel_get_default_config(chan);
+	channel_config_set_read_increment(&config, true);
+	channel_config_set_write_increment(&config, write_increment);
+	channel_config_set_sniff_enable(&config, true);
+	dma_sniffer_set_data_accumulator(0xFFFFFFFF);
+	dma_sniffer_enable(chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC32, true);
+	if(words > 0){
+		dma_channel_configure(chan, &config, dst, src, words, true);
+		dma_channel_wait_for_finish_blocking(chan);
+	}
+	uint32_t crc = dma_sniffer_get_data_accumulator();
+	dma_sniffer_disable();
+	dma_channel_unclaim(chan);
+	return crc;
+}
+
+// Header of the saved sequence in bank, as mapped through XIP
+const struct save_header * saved_header(uint32_t bank){
+	return (const struct save_header *) (XIP_BASE + SAVE_REGION_OFFSET + bank * SAVE_BANK_SIZE);
+}
+
+// Check a bank holds a saved sequence that fits in do_cmds
+int saved_header_valid(const struct save_header * header){
+	return header->magic == SAVE_MAGIC
+		&& header->format == SAVE_FORMAT
+		&& header->do_cmd_count <= MAX_DO_CMDS
+		&& header->do_cmd_count <= (SAVE_BANK_SIZE - FLASH_SECTOR_SIZE) / 4;
+}
+
+// What flash_write_bank writes
+struct flash_write {
+	uint32_t offset;
+	const uint8_t * header_page;
+	uint32_t data_bytes; // 0 to only rewrite the header
+};
+
+/*
+  Erase and program a bank. Runs from RAM with core1 parked, as flash
+  cannot be read through XIP while it is being written.
+ */
+void __not_in_flash_func(flash_write_bank)(const struct flash_write * write){
+	uint32_t erase_bytes = FLASH_SECTOR_SIZE
+		+ (write->data_bytes + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+	flash_range_erase(write->offset, write->data_bytes > 0 ? erase_bytes : FLASH_SECTOR_SIZE);
+	flash_range_program(write->offset, write->header_page, FLASH_PAGE_SIZE);
+	if(write->data_bytes > 0){
+		flash_range_program(write->offset + FLASH_SECTOR_SIZE, (const uint8_t *) do_cmds,
+							(write->data_bytes + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE);
+	}
+}
+
+/*
+  Write a header (and if with_data, the instruction table) to bank.
+
+  Returns 1 on success, otherwise prints why and returns 0.
+ */
+int write_bank(uint32_t bank, const struct save_header * header, int with_data){
+	uint8_t header_page[FLASH_PAGE_SIZE];
+	memset(header_page, 0xFF, FLASH_PAGE_SIZE);
+	memcpy(header_page, header, sizeof(*header));
+	struct flash_write write = {
+		.offset = SAVE_REGION_OFFSET + bank * SAVE_BANK_SIZE,
+		.header_page = header_page,
+		.data_bytes = with_data ? 4 * header->do_cmd_count : 0
+	};
+	// The multicore lockout in the SDK uses the FIFO core1 takes commands
+	// from, so park core1 through a command of its own instead
+	flash_lockout = 1;
+	multicore_fifo_push_blocking(FLASH_LOCKOUT);
+	multicore_fifo_pop_blocking();
+	uint32_t interrupts = save_and_disable_interrupts();
+	flash_write_bank(&write);
+	restore_interrupts(interrupts);
+	flash_lockout = 0;
+	return 1;
+}
+
+/*
+  Save the instruction table and periodic settings to bank, keeping the
+  bank's boot option. Returns 1 on success.
+ */
+int save_sequence(uint32_t bank){
+	if(4 * do_cmd_count > SAVE_BANK_SIZE - FLASH_SECTOR_SIZE){
+		fast_serial_printf("Sequence too large for a flash bank\r\n");
+		return 0;
+	}
+	uint64_t start = time_us_64();
+	const struct save_header * old = saved_header(bank);
+	uint32_t dummy;
+	struct save_header header = {
+		.magic = SAVE_MAGIC,
+		.format = SAVE_FORMAT,
+		.do_cmd_count = do_cmd_count,
+		.crc = dma_copy_crc(&dummy, do_cmds, do_cmd_count, false),
+		.periodic_start = periodic_start,
+		.periodic_count = periodic_count,
+		.periodic_trigger_stop = periodic_trigger_stop,
+		.boot = saved_header_valid(old) ? old->boot : BOOT_NONE
+	};
+	if(!write_bank(bank, &header, 1)){
+		return 0;
+	}
+	last_save_us = time_us_64() - start;
+	return 1;
+}
+
+/*
+  Load the instruction table and periodic settings from bank, copying the
+  instructions out of XIP with the DMA and checking their CRC on the way.
+  Returns 1 on success, otherwise prints why, clears do_cmds and returns 0.
+ */
+int load_sequence(uint32_t bank){
+	uint64_t start = time_us_64();
+	const struct save_header * header = saved_header(bank);
+	if(!saved_header_valid(header)){
+		fast_serial_printf("No saved sequence in bank %d\r\n", bank);
+		return 0;
+	}
+	const uint32_t * data = (const uint32_t *) ((uintptr_t) header + FLASH_SECTOR_SIZE);
+	uint32_t crc = dma_copy_crc(do_cmds, data, header->do_cmd_count, true);
+	branch_index_valid = 0;
+	invalidate_timing(0);
+	normalise_saved = 0;
+	// everything copied counts as part of the sequence until cut back
+	if(header->do_cmd_count > do_cmd_count){
+		do_cmd_count = header->do_cmd_count;
+	}
+	if(crc != header->crc){
+		set_do_cmd_count(0);
+		fast_serial_printf("Saved sequence in bank %d is corrupt\r\n", bank);
+		return 0;
+	}
+	set_do_cmd_count(header->do_cmd_count);
+	periodic_start = header->periodic_start;
+	periodic_count = header->periodic_count;
+	periodic_trigger_stop = header->periodic_trigger_stop;
+	last_load_us = time_us_64() - start;
+	return 1;
+}
+
+/*
+  Set what happens to the sequence saved in bank at boot. Only one bank can
+  be loaded at boot, so the option is cleared on every other bank.
+  Returns 1 on success.
+ */
+int set_boot_bank(uint32_t bank, uint32_t boot){
+	for(uint32_t i = 0; i < NUM_SAVE_BANKS; i++){
+		const struct save_header * old = saved_header(i);
+		if(!saved_header_valid(old)){
+			if(i == bank){
+				fast_serial_printf("No saved sequence in bank %d\r\n", bank);
+				return 0;
+			}
+			continue;
+		}
+		uint32_t new_boot = i == bank ? boot : BOOT_NONE;
+		if(old->boot != new_boot){
+			struct save_header header = *old;
+			header.boot = new_boot;
+			if(!write_bank(i, &header, 0)){
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/*
+  Load (and if asked to, arm) the sequence saved with a boot option
+ */
+void boot_load_sequence(void){
+	for(uint32_t bank = 0; bank < NUM_SAVE_BANKS; bank++){
+		const struct save_header * header = saved_header(bank);
+		if(!saved_header_valid(header) || header->boot == BOOT_NONE){
+			continue;
 		}
-		// Run command: start state machine
-		else if(strncmp(serial_buf, "run", 3) == 0){
+		if(load_sequence(bank) && header->boot == BOOT_RUN && prepare_run()){
 			multicore_fifo_push_blocking(BUFFERED_HWSTART);
-			fast_serial_printf("ok\r\n");
 		}
-		// Software start: start state machine without waiting for trigger
-		else if(strncmp(serial_buf, "swr", 3) == 0){
-			multicore_fifo_push_blocking(BUFFERED);
-			fast_serial_printf("ok\r\n");
+		return;
+	}
+}
+
+/*
+  Nominal duration of the instruction at addr in clock cycles. Waits count
+  as 0 (they last as long as their trigger takes), as do wait parameters and
+  branch targets, which are not output.
+ */
+uint64_t instruction_cycles(uint32_t addr){
+	if(addr >= MAX_INSTR){
+		return 0;
+	}
+	uint32_t reps = do_cmds[2*addr + 1];
+	if(reps == 0 || is_branch_target(addr) || wait_param_mode(addr) != WAIT_PLAIN){
+		return 0;
+	}
+	return (uint64_t) reps + 4;
+}
+
+/*
+  Number of clock cycles before the instruction at addr starts, running
+  the table in order from the start and not counting time spent in waits.
+  Addresses past the end of the sequence are taken as its end, so the
+  checkpoints built never go past timing_checkpoints.
+ */
+uint64_t cycles_before(uint32_t addr){
+	if(addr > do_cmd_count / 2){
+		addr = do_cmd_count / 2;
+	}
+	uint32_t k = addr / TIMING_STRIDE;
+	while(timing_checkpoints_valid <= k){
+		uint32_t last = timing_checkpoints_valid - 1;
+		uint64_t cycles = timing_checkpoints[last];
+		for(uint32_t i = last * TIMING_STRIDE; i < (last + 1) * TIMING_STRIDE; i++){
+			cycles += instruction_cycles(i);
 		}
-		// Manual update of outputs
-		else if(strncmp(serial_buf, "man", 3) == 0){
-			unsigned int manual_state;
-			int parsed = sscanf(serial_buf, "%*s %x", &manual_state);
-			if(parsed != 1){
-				fast_serial_printf("invalid request\r\n");
-			}
-			else{
-				// bit-shift state up by one to signal manual update
-				multicore_fifo_push_blocking(manual_state);
-				fast_serial_printf("ok\r\n");
-			}
+		timing_checkpoints[timing_checkpoints_valid++] = cycles;
+	}
+	uint64_t cycles = timing_checkpoints[k];
+	for(uint32_t i = k * TIMING_STRIDE; i < addr; i++){
+		cycles += instruction_cycles(i);
+	}
+	return cycles;
+}
+
+/*
+  Find the instruction being output the given number of clock cycles into
+  the sequence (as counted by cycles_before). Returns the number of
+  instructions if the sequence is over by then.
+ */
+uint32_t instruction_at(uint64_t cycles){
+	uint32_t num_instr = do_cmd_count / 2;
+	// make sure every checkpoint within the sequence is built
+	cycles_before(num_instr);
+	uint32_t lo = 0;
+	uint32_t hi = num_instr / TIMING_STRIDE;
+	while(lo < hi){
+		uint32_t mid = (lo + hi + 1) / 2;
+		if(timing_checkpoints[mid] <= cycles){
+			lo = mid;
 		}
-		// Get current output state
-		else if(strncmp(serial_buf, "gto", 3) == 0){
-			unsigned int all_state = gpio_get_all();
-			unsigned int manual_state = (output_mask & all_state) >> OUTPUT_PIN_BASE;
-			fast_serial_printf("%x\r\n", manual_state);
-		}
-		// Set instruction by address
-		else if(strncmp(serial_buf, "set", 3) == 0){
-			uint32_t addr;
-			uint32_t do_cmd_addr;
-			uint32_t output;
-			uint32_t reps;
-			int parsed = sscanf(serial_buf, "%*s %x %x %x", &addr, &output, &reps);
-			if (parsed < 3) {
-				fast_serial_printf("Invalid instruction\r\n");
-			}
-			else if (addr >= MAX_INSTR){
-				fast_serial_printf("Invalid instruction address %x\r\n", addr);
+		else{
+			hi = mid - 1;
+		}
+	}
+	uint64_t start = timing_checkpoints[lo];
+	for(uint32_t addr = lo * TIMING_STRIDE; addr < num_instr; addr++){
+		start += instruction_cycles(addr);
+		if(start > cycles){
+			return addr;
+		}
+	}
+	return num_instr;
+}
+
+/* Measure system frequencies
+From https://github.com/raspberrypi/pico-examples under BSD-3-Clause License
+*/
+void measure_freqs(void)
+{
+    uint f_pll_sys = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_PLL_SYS_CLKSRC_PRIMARY);
+    uint f_pll_usb = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_PLL_USB_CLKSRC_PRIMARY);
+    uint f_rosc = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_ROSC_CLKSRC);
+    uint f_clk_sys = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS);
+    uint f_clk_peri = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_PERI);
+    uint f_clk_usb = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_USB);
+    uint f_clk_adc = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_ADC);
+#ifdef CLOCKS_FC0_SRC_VALUE_CLK_RTC
+    uint f_clk_rtc = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_RTC);
+#endif
+
+    fast_serial_printf("pll_sys = %dkHz\r\n", f_pll_sys);
+    fast_serial_printf("pll_usb = %dkHz\r\n", f_pll_usb);
+    fast_serial_printf("rosc = %dkHz\r\n", f_rosc);
+    fast_serial_printf("clk_sys = %dkHz\r\n", f_clk_sys);
+    fast_serial_printf("clk_peri = %dkHz\r\n", f_clk_peri);
+    fast_serial_printf("clk_usb = %dkHz\r\n", f_clk_usb);
+    fast_serial_printf("clk_adc = %dkHz\r\n", f_clk_adc);
+#ifdef CLOCKS_FC0_SRC_VALUE_CLK_RTC
+    fast_serial_printf("clk_rtc = %dkHz\r\n", f_clk_rtc);
+#endif
+    fast_serial_printf("boot clk_sys = %dkHz (expected %dkHz): %s\r\n", boot_clock_khz,
+                       DEFAULT_SYS_CLOCK_KHZ, boot_clock_ok ? "pass" : "FAIL");
+}
+
+/* Set the system clock used at boot, raising the core voltage first in the
+   overclocked build, then check clk_sys really runs at that frequency.
+   If it does not, fall back to the stock 100 MHz.
+*/
+void init_sys_clock(void) {
+#ifdef PRAWNDO_OVERCLOCK
+	vreg_set_voltage(OVERCLOCK_VOLTAGE);
+	// let the regulator settle before speeding up
+	sleep_ms(10);
+#endif
+	set_sys_clock_khz(DEFAULT_SYS_CLOCK_KHZ, false);
+
+	boot_clock_khz = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS);
+	boot_clock_ok = abs((int) boot_clock_khz - DEFAULT_SYS_CLOCK_KHZ) <= CLOCK_TOLERANCE_KHZ;
+	if(!boot_clock_ok){
+		set_sys_clock_khz(100000, false);
+		resus_clock_khz = 100000;
+#ifdef PRAWNDO_OVERCLOCK
+		// back in spec, so the raised voltage is no longer needed
+		vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+#endif
+	}
+}
+
+/* Resusitation function that restarts the clock internally if there are any 
+   issues with syncing the external clock or invalid changes to the clock
+*/
+void clk_resus(void) {
+	// Restarting the internal clock at the frequency the boot self-test
+	// validated (set in kHz)
+	set_sys_clock_khz(resus_clock_khz, false);
+
+	// Record the event (reported by tlm), and that any run going on is
+	// no longer timed correctly. Pin 20 is left as a clock input, so the
+	// clock monitor can see the reference return.
+	resus_count++;
+	last_resus_us = time_us_64();
+	if(status != STOPPED && status != ABORTED){
+		run_clock_fault = 1;
+	}
+	clock_lost = clk_status == EXTERNAL;
+	clock_relock_periods = 0;
+	clock_locked = 0;
+
+	clk_status = INTERNAL;
+}
+
+
+
+// Clock cycles since the SysTick count since was read (up to 2^24)
+static inline uint32_t systick_elapsed(uint32_t since){
+	return (since - systick_hw->cvr) & 0xFFFFFF;
+}
+
+// Clock cycles since the SysTick count start was read at time start_us.
+// Intervals too long for SysTick are counted in microseconds instead.
+uint64_t cycles_since(uint32_t start, uint64_t start_us){
+	uint64_t cycles = (time_us_64() - start_us) * (clock_get_hz(clk_sys) / 1000000);
+	if(cycles >= 0x800000){
+		return cycles;
+	}
+	return systick_elapsed(start);
+}
+
+/*
+  Clock monitor, called every CLOCK_MONITOR_MS by a core0 timer
+
+  Counts clk_sys with core0's SysTick against the microsecond timer (which
+  runs from the crystal, whatever clk_sys is) to find the external clock's
+  drift. After a resus, it leaves counting the reference to clock_relock_task,
+  as that takes too long for an interrupt.
+  This runs in an interrupt, so the run status is read without its mutex.
+ */
+bool clock_monitor(struct repeating_timer * timer){
+	uint32_t now = systick_hw->cvr;
+	uint64_t now_us = time_us_64();
+	// rounding the MHz up errs towards dropping a window that was countable
+	uint64_t gap_cycles = (now_us - clock_last_tick_us) * (clock_get_hz(clk_sys) / 1000000 + 1);
+	uint32_t cycles = (clock_last_systick - now) & 0xFFFFFF;
+	clock_last_systick = now;
+	clock_last_tick_us = now_us;
+	int idle = status == STOPPED || status == ABORTED;
+
+	if(clk_status == EXTERNAL && clock_ext_freq > 0){
+		if(gap_cycles >= 0x1000000){
+			// SysTick may have wrapped since the last tick, so the window is lost
+			clock_window_periods = 0;
+			clock_window_cycles = 0;
+			clock_window_start_us = now_us;
+			return true;
+		}
+		clock_window_cycles += cycles;
+		if(++clock_window_periods >= CLOCK_MONITOR_WINDOW){
+			int64_t expected = (int64_t) clock_ext_freq * (int64_t) (now_us - clock_window_start_us) / 1000000;
+			clock_drift_ppm = ((int64_t) clock_window_cycles - expected) * 1000000 / expected;
+			if(abs(clock_drift_ppm) > abs(max_clock_drift_ppm)){
+				max_clock_drift_ppm = clock_drift_ppm;
 			}
-			// confirm output is valid
-			else if(output & ~output_mask){
-				fast_serial_printf("Invalid output specification %x\r\n", output);
+			clock_locked = abs(clock_drift_ppm) <= CLOCK_LOCK_PPM;
+			if(!clock_locked && !idle){
+				run_clock_fault = 1;
 			}
-			// confirm reps is valid
-			else if(reps < 5 && reps != 0){
-				fast_serial_printf("Reps must be 0 or greater than 4, got %x\r\n", reps);
+			clock_window_periods = 0;
+			clock_window_cycles = 0;
+			clock_window_start_us = now_us;
+		}
+		return true;
+	}
+	clock_window_periods = 0;
+	clock_window_cycles = 0;
+	clock_window_start_us = now_us;
+	if(clock_lost){
+		clock_relock_due = 1;
+	}
+	return true;
+}
+
+/*
+  Re-select the external clock once it returns after a resus, called by
+  core0's main loop while it waits for a command
+
+  Once per clock monitor period, counts the reference on pin 20, and selects
+  it again once it has been close to the requested frequency for
+  CLOCK_RELOCK_PERIODS periods in a row, if no sequence is running.
+ */
+void clock_relock_task(){
+	if(!clock_relock_due){
+		return;
+	}
+	clock_relock_due = 0;
+	if(!clock_lost){
+		return;
+	}
+	uint32_t ref_khz = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLKSRC_GPIN0);
+	uint32_t want_khz = clock_ext_freq / 1000;
+	if(abs((int) ref_khz - (int) want_khz) <= (int) (want_khz / 1000) + 1){
+		clock_relock_periods++;
+	}
+	else{
+		clock_relock_periods = 0;
+	}
+	int local_status = get_status();
+	if(clock_relock_periods >= CLOCK_RELOCK_PERIODS && (local_status == STOPPED || local_status == ABORTED)){
+		// keep the monitor from running half way through the switch
+		uint32_t interrupts = save_and_disable_interrupts();
+		clock_configure_gpin(clk_sys, CLOCK_IN_PIN, clock_ext_freq, clock_ext_freq);
+		clock_lost = 0;
+		clk_status = EXTERNAL;
+		relock_count++;
+		last_relock_us = time_us_64();
+		// the SysTick count spans the clock change, so start afresh
+		clock_last_systick = systick_hw->cvr;
+		clock_last_tick_us = time_us_64();
+		clock_window_start_us = clock_last_tick_us;
+		restore_interrupts(interrupts);
+	}
+}
+
+/*
+  Stress test
+
+  Replays a block of minimum length (5 cycle) pulses toggling every output
+  in periodic mode for duration_ms, while core0 reads do_cmds and sends
+  checksums over USB, so the DMA competes with both cores and USB for the
+  bus. Afterwards, reports whether the PIO ever waited on an empty FIFO.
+  This replaces the programmed sequence.
+ */
+void stress_test(uint32_t duration_ms){
+	set_do_cmd_count(0);
+	for(uint32_t i = 0; i < STRESS_INSTR; i++){
+		do_cmds[2*i] = (i & 1) ? OUTPUT_WORD_MASK : 0;
+		do_cmds[2*i + 1] = 1;
+	}
+	do_cmd_count = 2 * STRESS_INSTR;
+	branch_count = 0;
+	branch_index_valid = 0;
+	invalidate_timing(0);
+
+	uint32_t old_start = periodic_start;
+	uint32_t old_count = periodic_count;
+	unsigned short old_trigger_stop = periodic_trigger_stop;
+	periodic_start = 0;
+	periodic_count = STRESS_INSTR;
+	periodic_trigger_stop = 0;
+
+	multicore_fifo_push_blocking(BUFFERED);
+	while(get_status() != RUNNING){
+		tight_loop_contents();
+	}
+	absolute_time_t end = make_timeout_time_ms(duration_ms);
+	while(!time_reached(end)){
+		uint32_t checksum = 0;
+		for(uint32_t i = 0; i < do_cmd_count; i++){
+			checksum += do_cmds[i];
+		}
+		fast_serial_printf("checksum: %08x\r\n", checksum);
+	}
+	set_status(ABORT_REQUESTED);
+	while(get_status() != ABORTED){
+		tight_loop_contents();
+	}
+
+	periodic_start = old_start;
+	periodic_count = old_count;
+	periodic_trigger_stop = old_trigger_stop;
+	set_do_cmd_count(0);
+	fast_serial_printf("starved: %d\r\n", last_run_starved);
+}
+
+void __not_in_flash_func(core1_entry)() {
+	// Setup PIO
+	PIO pio = pio0;
+	uint sm = pio_claim_unused_sm(pio, true);
+	uint dma_chan = dma_claim_unused_channel(true);
+	uint reload_chan = dma_claim_unused_channel(true);
+	run_pio = pio;
+	run_sm = sm;
+	run_dma_chan = dma_chan;
+	uint offset = pio_add_program(pio, &prawn_do_program); // load prawn_do PIO 
+														   // program
+
+	// initialize prawn_do PIO program on chosen PIO and state machine at 
+	// required offset
+	pio_sm_config pio_config = prawn_do_program_init(pio, sm, offset);
+
+	// SysTick counts down at the system clock, to time branch latency
+	systick_hw->rvr = 0xFFFFFF;
+	systick_hw->cvr = 0;
+	systick_hw->csr = 0x5;
+
+	// signal core1 ready for commands
+	multicore_fifo_push_blocking(0);
+
+	while(1){
+		// wait for message from main core
+		uint32_t command = multicore_fifo_pop_blocking();
+		uint32_t command_time = systick_hw->cvr;
+
+		if(command & BUFFERED){
+			// buffered execution
+			uint32_t hwstart = !!(command & HWSTART);
+
+			set_status(TRANSITION_TO_RUNNING);
+			// a run armed while the external clock is lost is already mistimed
+			run_clock_fault = clock_lost;
+			if(debug){
+				fast_serial_printf("hwstart: %d\r\n", hwstart);
 			}
-			else {
-				do_cmd_addr = addr * 2;
-				do_cmds[do_cmd_addr] = output;
-				if(reps != 0){
-					// Adjust from the number of 10ns reps 
-					// to reps adding onto the base 50 ns pulse width
-					reps -= 4;
+			// In periodic mode with trigger stop, count rising edges on the
+			// trigger pin. A hardware start consumes the first edge unless
+			// the trigger is already high when armed.
+			uint32_t trigger_stop = periodic_count > 0 && periodic_trigger_stop;
+			uint32_t trigger_level = gpio_get(TRIGGER_PIN);
+			uint32_t stop_edges = (hwstart && !trigger_level) ? 2 : 1;
+			// Branch points end a DMA segment, and the PIO sends the branch
+			// pins it samples there back to pick where the next one starts
+			uint32_t branching = periodic_count == 0 && branch_count > 0;
+			uint32_t branch = next_branch(0);
+
+			// start the state machine, leaving the outputs the run does not
+			// own as they are
+			release_unowned_outputs();
+			start_sm(pio, sm, dma_chan, reload_chan, offset, hwstart, segment_words(0, branch));
+			arm_cycles = systick_elapsed(command_time);
+			set_status(RUNNING);
+			uint32_t last_poll = systick_hw->cvr;
+
+			// can save IRQ PIO instruction by using the following check instead
+			//while ((dma_channel_is_busy(dma_chan) // checks if dma finished
+			//        || pio_sm_is_tx_fifo_empty(pio, sm)) // ensure fifo is empty once dma finishes
+			//	     && get_status() != ABORT_REQUESTED) // breaks if Abort requested
+			while (!pio_interrupt_get(pio, sm) // breaks if PIO program reaches end
+				&& get_status() != ABORT_REQUESTED // breaks if Abort requested
+				){
+				// tight loop checking for run completion
+				// exits if program signals IRQ (at end) or abort requested
+				uint32_t poll = systick_hw->cvr;
+				if(branching && !pio_sm_is_rx_fifo_empty(pio, sm)){
+					uint32_t pins = pio_sm_get(pio, sm);
+					uint32_t param = branch_params[branch];
+					uint32_t num_pins = do_cmds[2*param] & OUTPUT_WORD_MASK;
+					uint32_t target = do_cmds[2*(param + 1 + (pins & ((1u << num_pins) - 1))) + 1];
+					branch = next_branch(target);
+					dma_channel_transfer_from_buffer_now(dma_chan, &do_cmds[2*target],
+														 segment_words(target, branch));
+					// the pins were sampled some time after the previous poll
+					// found the FIFO empty, so this bounds the latency
+					uint32_t cycles = systick_elapsed(last_poll);
+					if(cycles > max_branch_cycles){
+						max_branch_cycles = cycles;
+					}
+					branch_taken_count++;
 				}
-				do_cmds[do_cmd_addr + 1] = reps;
-				// update do_cmd_count if we have increased it
-				if(do_cmd_addr+1 > do_cmd_count){
-					// +2 to account for zero indexing of addr
-					do_cmd_count = do_cmd_addr + 2;
+				if(((last_poll - poll) & 0xFFFFFF) > max_poll_cycles){
+					max_poll_cycles = (last_poll - poll) & 0xFFFFFF;
 				}
-				else if(reps == 0 && addr != 0 && do_cmds[do_cmd_addr-1] == 0){
-					// reset if we just set a stop command (two reps=0 commands in a row)
-					do_cmd_count = do_cmd_addr + 2;
+				last_poll = poll;
+				if(trigger_stop){
+					uint32_t level = gpio_get(TRIGGER_PIN);
+					if(level && !trigger_level){
+						stop_edges--;
+					}
+					trigger_level = level;
+					if(stop_edges == 0){
+						break; // periodic run stopped by trigger
+					}
 				}
-				if (debug){
-					fast_serial_printf("NumNZ: %x, Arr Idx: %x, Output: %x, Reps: %x\r\n", 
-						do_cmd_count, do_cmd_addr, output, reps);
+			}
+			// Read the stall flag before stopping, as stopping the DMA first
+			// can stall the state machine
+			uint32_t starved = !!(pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + sm)));
+			if(debug){
+				fast_serial_printf("Tight execution loop ended\r\n");
+				uint8_t pc = pio_sm_get_pc(pio, sm);
+				fast_serial_printf("Program ended at instr %d\r\n", pc-offset);
+			}
+
+			uint32_t stop_time = systick_hw->cvr;
+			if(get_status() == ABORT_REQUESTED){
+				set_status(ABORTING);
+				stop_sm(pio, sm, dma_chan, reload_chan);
+				stop_cycles = systick_elapsed(stop_time);
+				set_status(ABORTED);
+				if(debug){
+					fast_serial_printf("Aborted execution\r\n");
 				}
-				fast_serial_printf("ok\r\n");
 			}
-		}
-		// Get instruction at address
-		else if(strncmp(serial_buf, "get", 3) == 0){
-			uint32_t addr;
-			uint32_t output;
-			uint32_t reps;
-			int parsed = sscanf(serial_buf, "%*s %x", &addr);
-			if(parsed < 1){
-				fast_serial_printf("Invalid request\r\n");
+			else{
+				set_status(TRANSITION_TO_STOP);
+				stop_sm(pio, sm, dma_chan, reload_chan);
+				stop_cycles = systick_elapsed(stop_time);
+				set_status(STOPPED);
+				if(debug){
+					fast_serial_printf("Execution stopped\r\n");
+				}
+			}
+			// The program stalls on its end flag until the state machine is
+			// stopped, so only clear it afterwards
+			pio_interrupt_clear(pio, sm);
+			reclaim_unowned_outputs(pio, sm);
+
+			run_count++;
+			if(arm_cycles < min_arm_cycles){
+				min_arm_cycles = arm_cycles;
+			}
+			if(arm_cycles > max_arm_cycles){
+				max_arm_cycles = arm_cycles;
+			}
+			if(stop_cycles > max_stop_cycles){
+				max_stop_cycles = stop_cycles;
 			}
-			else if(addr*2+1 > do_cmd_count){
-				fast_serial_printf("Invalid address\r\n");
+			last_run_timed_out = pio_interrupt_get(pio, 4 + sm);
+			if(last_run_timed_out){
+				timeout_run_count++;
 			}
-			else {
-				output = do_cmds[addr*2];
-				reps = do_cmds[addr*2+1];
-				if(reps != 0){
-					reps += 4;
+			last_run_starved = starved;
+			last_run_clock_invalid = run_clock_fault;
+			if(last_run_clock_invalid){
+				clock_invalid_run_count++;
+			}
+			if(last_run_starved){
+				starved_run_count++;
+			}
+			if(debug){
+				fast_serial_printf("Core1 loop ended\r\n");
+			}
+		}
+		else if(command == DECODE){
+			// Decode records as core0 receives them, in contiguous batches
+			uint32_t decoded = 0;
+			while(decoded < decode_count){
+				uint32_t pos = decode_tail % DECODE_RING_SIZE;
+				uint32_t records = (decode_head - decode_tail) / ADM_RECORD_SIZE;
+				if(records > (DECODE_RING_SIZE - pos) / ADM_RECORD_SIZE){
+					records = (DECODE_RING_SIZE - pos) / ADM_RECORD_SIZE;
 				}
-				fast_serial_printf("%x %x\r\n", output, reps);
+				if(records == 0){
+					continue;
+				}
+				// read the records only after seeing them written
+				__dmb();
+				decode_error_count += decode_binary_instructions(&decode_ring[pos], decode_addr + decoded,
+																 records, &decode_last_error);
+				decoded += records;
+				__dmb();
+				decode_tail += ADM_RECORD_SIZE * records;
+			}
+			multicore_fifo_push_blocking(0);
+		}
+		else if(command == FLASH_LOCKOUT){
+			// Only run code from RAM until core0 has finished with flash
+			uint32_t interrupts = save_and_disable_interrupts();
+			multicore_fifo_push_blocking_inline(0);
+			while(flash_lockout){
+				tight_loop_contents();
 			}
+			restore_interrupts(interrupts);
 		}
-		// Add command: read in hexadecimal integers separated by newlines, 
-		// append to command array
-		else if(strncmp(serial_buf, "add", 3) == 0){
+		else{
+			// manual update
+			uint32_t manual_state = command;
+			pio_sm_set_pins_with_mask(pio, sm, manual_state << OUTPUT_PIN_BASE, output_mask);
+			if(debug){
+				fast_serial_printf("Output commanded: %x\r\n", manual_state);
+			}
 			
-			while(do_cmd_count < MAX_DO_CMDS-3){
-				uint32_t output;
-				uint32_t reps;
-				unsigned short num_inputs = 0;
-
-				do {
-				// Read in the command provided by the user
-				// FORMAT: <output> <reps> <REPS = 0: Indefinite Wait>
-					buf_len = fast_serial_read_until(serial_buf, SERIAL_BUFFER_SIZE, '\n');
-
-				// Check if the user inputted "end", and if so, exit add mode
-				if(buf_len >= 3){
-					if(strncmp(serial_buf, "end", 3) == 0){
-						break; // breaks inner read loop
-					}
-				}
+		}
+	}
+}
 
-				// Read the input provided in the serial buffer into the 
-				// output, and reps variables. Also storing the return
-				// value of sscanf (number of variables successfully read in)
-				// to determine if the user wants to program a stop/wait
-				num_inputs = sscanf(serial_buf, "%x %x", &output, &reps);
+// Version command: return firmware version
+void cmd_ver(unsigned int buf_len, int local_status){
+	fast_serial_printf("Version: %s\r\n", ver);
+}
 
-				} while (num_inputs < 2);
+// Board command: return which pico the firmware was built for
+void cmd_brd(unsigned int buf_len, int local_status){
+	fast_serial_printf("board: pico%d\r\n", PRAWNDO_PICO_BOARD);
+}
 
-				if(strncmp(serial_buf, "end", 3) == 0){
-					fast_serial_printf("ok\r\n");
-					break; // breaks add mode loop
-				}
+// Status command: return running status
+void cmd_sts(unsigned int buf_len, int local_status){
+	fast_serial_printf("run-status:%d clock-status:%d\r\n", local_status, clk_status);
+}
 
-				//DEBUG MODE:
-				// Printing to the user what the program received as input
-				// for the output, reps, and optionally wait if the user inputted
-				// that
-				if (debug) {
-					fast_serial_printf("Output: %x\r\n", output);
-					fast_serial_printf("Number of Reps: %d\r\n", reps);
+// Telemetry command: report what happened during recent runs
+void cmd_tlm(unsigned int buf_len, int local_status){
+	fast_serial_printf("runs: %d\r\n", run_count);
+	fast_serial_printf("timed-out-runs: %d\r\n", timeout_run_count);
+	fast_serial_printf("last-run-timed-out: %d\r\n", last_run_timed_out);
+	fast_serial_printf("branches-taken: %d\r\n", branch_taken_count);
+	fast_serial_printf("max-branch-cycles: %d\r\n", max_branch_cycles);
+	fast_serial_printf("arm-cycles: %d min: %d max: %d\r\n", arm_cycles,
+					   run_count > 0 ? min_arm_cycles : 0, max_arm_cycles);
+	fast_serial_printf("stop-cycles: %d max: %d\r\n", stop_cycles, max_stop_cycles);
+	fast_serial_printf("max-poll-cycles: %d\r\n", max_poll_cycles);
+	fast_serial_printf("starved-runs: %d\r\n", starved_run_count);
+	fast_serial_printf("last-run-starved: %d\r\n", last_run_starved);
+	fast_serial_printf("last-save-us: %d\r\n", last_save_us);
+	fast_serial_printf("last-load-us: %d\r\n", last_load_us);
+	fast_serial_printf("clock-locked: %d drift-ppm: %d max: %d\r\n", clock_locked, clock_drift_ppm, max_clock_drift_ppm);
+	fast_serial_printf("clock-lost: %d\r\n", clock_lost);
+	fast_serial_printf("resus: %d last-us: %" PRIu64 "\r\n", resus_count, last_resus_us);
+	fast_serial_printf("relocks: %d last-us: %" PRIu64 "\r\n", relock_count, last_relock_us);
+	fast_serial_printf("clock-invalid-runs: %d\r\n", clock_invalid_run_count);
+	fast_serial_printf("last-run-clock-invalid: %d\r\n", last_run_clock_invalid);
+}
 
-					if (reps == 0){
-						fast_serial_printf("Wait\r\n");
-					}
-				}
+// Progress command: report which instruction is being output, and the
+// cycles (excluding waits) elapsed before it and left after it
+void cmd_pos(unsigned int buf_len, int local_status){
+	if(local_status != RUNNING){
+		fast_serial_printf("Not running\r\n");
+		return;
+	}
+	// Words the PIO has taken: read by the DMA and no longer in the FIFO.
+	// Just after the DMA wraps round a periodic block (or jumps to a branch
+	// target), the FIFO still holds words from before, so this can be
+	// negative.
+	uint32_t words_read = (dma_hw->ch[run_dma_chan].read_addr - (uintptr_t) do_cmds) / 4;
+	int32_t consumed = (int32_t) words_read - (int32_t) pio_sm_get_tx_fifo_level(run_pio, run_sm);
+	// The OSR may already hold the output word of the next instruction
+	uint32_t addr;
+	if(periodic_count > 0){
+		// position within the block, which is a power of two long, so
+		// wrapped arithmetic gives it modulo the block
+		uint32_t offset = (uint32_t) (consumed - 2 * (int32_t) periodic_start) & (2 * periodic_count - 1);
+		addr = periodic_start + (offset >= 2 ? offset / 2 - 1 : periodic_count - 1);
+	}
+	else{
+		addr = consumed >= 2 ? consumed / 2 - 1 : 0;
+	}
+	uint32_t end = periodic_count > 0 ? periodic_start + periodic_count : do_cmd_count / 2;
+	uint64_t elapsed = cycles_before(addr);
+	uint64_t remaining = cycles_before(end) - elapsed;
+	if(periodic_count > 0){
+		// report the time within the current pass of the block
+		elapsed -= cycles_before(periodic_start);
+	}
+	fast_serial_printf("instruction: %x elapsed: %" PRIu64 " remaining: %" PRIu64 "\r\n",
+					   addr, elapsed, remaining);
+}
 
-				// confirm output is valid
-				if(output & ~output_mask){
-					fast_serial_printf("Invalid output specification %x\r\n", output);
-					break;
-				}
-				// confirm reps is valid
-				if(reps < 5 && reps != 0){
-					fast_serial_printf("Reps must be 0 or greater than 4, got %x\r\n", reps);
-					break;
-				}
+// Time lookup command: print the instruction output at a given time
+// FORMAT: tim <cycles into the sequence>
+void cmd_tim(unsigned int buf_len, int local_status){
+	uint64_t cycles;
+	int parsed = sscanf(serial_buf, "%*s %" SCNx64, &cycles);
+	if(parsed < 1){
+		fast_serial_printf("Invalid request\r\n");
+		return;
+	}
+	fast_serial_printf("%x\r\n", instruction_at(cycles));
+}
+
+// Benchmark command: report the command handling costs measured since the
+// last bch (averaged per command), time sscanf and the last adm upload, then
+// reset the counters
+void cmd_bch(unsigned int buf_len, int local_status){
+	uint64_t elapsed_us = time_us_64() - bench_start_us;
+	uint32_t commands = bench_commands > 0 ? bench_commands : 1;
+	uint32_t lines = bench_lines > 0 ? bench_lines : 1;
+
+	// Parse a typical command line, as the handlers do
+	uint32_t start = systick_hw->cvr;
+	for(uint32_t i = 0; i < BENCH_SSCANF_REPS; i++){
+		unsigned int output;
+		unsigned int reps;
+		sscanf("set 1a2b 3c4d 5e6f7", "%*s %x %x", &output, &reps);
+	}
+	uint32_t sscanf_cycles = systick_elapsed(start) / BENCH_SSCANF_REPS;
+
+	fast_serial_printf("commands: %d\r\n", bench_commands);
+	fast_serial_printf("elapsed-us: %" PRIu64 "\r\n", elapsed_us);
+	fast_serial_printf("commands-per-s: %" PRIu64 "\r\n",
+					   elapsed_us > 0 ? (uint64_t) bench_commands * 1000000 / elapsed_us : 0);
+	fast_serial_printf("read-until-cycles: %" PRIu64 "\r\n", bench_read_cycles / lines);
+	fast_serial_printf("handler-cycles: %" PRIu64 "\r\n", bench_handler_cycles / commands);
+	fast_serial_printf("write-cycles: %" PRIu64 "\r\n", bench_write_cycles / commands);
+	fast_serial_printf("sscanf-cycles: %d\r\n", sscanf_cycles);
+	fast_serial_printf("adm-bytes: %d us: %d kb-per-s: %d\r\n", bench_adm_bytes, bench_adm_us,
+					   bench_adm_us > 0 ? (uint32_t) ((uint64_t) bench_adm_bytes * 1000 / bench_adm_us) : 0);
+
+	bench_commands = 0;
+	bench_lines = 0;
+	bench_read_cycles = 0;
+	bench_handler_cycles = 0;
+	bench_write_cycles = 0;
+	bench_start_us = time_us_64();
+}
 
-				// Reading in the 16-bit word to output to the pins
-				do_cmds[do_cmd_count] = output;
-				do_cmd_count++;
+// Enable debug mode
+void cmd_deb(unsigned int buf_len, int local_status){
+	debug = 1;
+	fast_serial_printf("ok\r\n");
+}
 
-				do_cmds[do_cmd_count] = reps;
+// Disable debug mode
+void cmd_ndb(unsigned int buf_len, int local_status){
+	debug = 0;
+	fast_serial_printf("ok\r\n");
+}
 
-				// If reps is not zero, this adjusts them from the number
-				// of 10ns reps to reps adding onto the base 50 ns pulse
-				// width
-				if (do_cmds[do_cmd_count] != 0) {
-					do_cmds[do_cmd_count] -= 4;
-				}
-				do_cmd_count++;
-				
-			}
-			if(do_cmd_count == MAX_DO_CMDS-1){
-				fast_serial_printf("Too many DO commands (%d). Please use resources more efficiently or increase MAX_DO_CMDS and recompile.\r\n", MAX_DO_CMDS);
+// Abort command: stop run by stopping state machine
+void cmd_abt(unsigned int buf_len, int local_status){
+	if(local_status == RUNNING || local_status == TRANSITION_TO_RUNNING){
+		set_status(ABORT_REQUESTED);
+		fast_serial_printf("ok\r\n");
+	}
+	else {
+		fast_serial_printf("Can only abort when status is 1 or 2\r\n");
+	}
+}
+
+// Clear command: empty the buffered outputs
+void cmd_cls(unsigned int buf_len, int local_status){
+	set_do_cmd_count(0);
+	normalise_saved = 0;
+	branch_index_valid = 0;
+	fast_serial_printf("ok\r\n");
+}
+
+// Run command: start state machine
+void cmd_run(unsigned int buf_len, int local_status){
+	if(!prepare_run()){
+		return;
+	}
+	multicore_fifo_push_blocking(BUFFERED_HWSTART);
+	fast_serial_printf("ok\r\n");
+}
+
+// Software start: start state machine without waiting for trigger
+void cmd_swr(unsigned int buf_len, int local_status){
+	if(!prepare_run()){
+		return;
+	}
+	multicore_fifo_push_blocking(BUFFERED);
+	fast_serial_printf("ok\r\n");
+}
+
+// Periodic mode: replay a block of instructions until aborted/triggered
+// FORMAT: per <start addr> <num instructions> <stop on trigger:0,1>
+void cmd_per(unsigned int buf_len, int local_status){
+	uint32_t start_addr;
+	uint32_t inst_count;
+	uint32_t trigger_stop = 0;
+	int parsed = sscanf(serial_buf, "%*s %x %x %x", &start_addr, &inst_count, &trigger_stop);
+	if(parsed < 2){
+		fast_serial_printf("Invalid request\r\n");
+		return;
+	}
+	uint32_t old_start = periodic_start;
+	uint32_t old_count = periodic_count;
+	periodic_start = start_addr;
+	periodic_count = inst_count;
+	if(inst_count > 0 && !periodic_block_valid()){
+		periodic_start = old_start;
+		periodic_count = old_count;
+		fast_serial_printf("Invalid periodic block (%x + %x). Need a power of two <= %x, aligned, no waits.\r\n", start_addr, inst_count, MAX_PERIODIC_INSTR);
+		return;
+	}
+	periodic_trigger_stop = !!trigger_stop;
+	fast_serial_printf("ok\r\n");
+}
+
+// Channel mask command: set which outputs runs drive, the rest keep their
+// manual state. With no mask, print the current one.
+// FORMAT: msk <mask>
+void cmd_msk(unsigned int buf_len, int local_status){
+	uint32_t mask;
+	int parsed = sscanf(serial_buf, "%*s %x", &mask);
+	if(parsed < 1){
+		fast_serial_printf("%x\r\n", run_output_mask);
+	}
+	else if(mask & ~OUTPUT_WORD_MASK){
+		fast_serial_printf("Invalid output mask %x\r\n", mask);
+	}
+	else{
+		run_output_mask = mask;
+		// list the pins to release once here, rather than each time a run is armed
+		unowned_pin_mask = (OUTPUT_WORD_MASK & ~mask) << OUTPUT_PIN_BASE;
+		unowned_pin_count = 0;
+		for(uint pin = OUTPUT_PIN_BASE; pin < OUTPUT_PIN_BASE + OUTPUT_WIDTH; pin++){
+			if(unowned_pin_mask & (1u << pin)){
+				unowned_pins[unowned_pin_count++] = pin;
 			}
 		}
-		// Add many command: read in a fixed number of binary integers without separation,
-		// append to command array
-		else if(strncmp(serial_buf, "adm", 3) == 0){
-			// Get how many instructions this adm command contains and where to insert them
-			uint32_t start_addr;
-			uint32_t inst_count;
-			int parsed = sscanf(serial_buf, "%*s %x %x", &start_addr, &inst_count);
-			if(parsed < 2){
-				fast_serial_printf("Invalid request\r\n");
-				continue;
-			}
-			// Check that the instructions will fit in the do_cmds array
-			else if(inst_count + start_addr > MAX_INSTR){
-				fast_serial_printf("Invalid address and/or too many instructions (%d + %d).\r\n", start_addr, inst_count);
-				continue;
-			}
-			else{
-				fast_serial_printf("ready\r\n");
-			}
+		fast_serial_printf("ok\r\n");
+	}
+}
 
-			// reset do_cmd_count to start_address
-			do_cmd_count = start_addr * 2;
-
-			uint32_t reps_error_count = 0;
-			uint32_t last_reps_error_idx = 0;
-
-			// It takes 6 bytes to describe an instruction: 2 bytes for values, 4 bytes for time
-			uint32_t inst_per_buffer = SERIAL_BUFFER_SIZE / 6;
-			// In this loop, we read nearly full serial buffers and load them into do_cmds.
-			while(inst_count > inst_per_buffer){
-				fast_serial_read(serial_buf, 6*inst_per_buffer);
-
-				for(int i = 0; i < inst_per_buffer; i++){
-					do_cmds[do_cmd_count] = (serial_buf[6*i+1] << 8) | serial_buf[6*i];
-					do_cmd_count++;
-					uint32_t reps = ((serial_buf[6*i+5] << 24)
-									 | (serial_buf[6*i+4] << 16)
-									 | (serial_buf[6*i+3] << 8)
-									 | serial_buf[6*i+2]);
-					if(reps < 5 && reps != 0){
-						reps_error_count++;
-						last_reps_error_idx = (do_cmd_count + 1) / 2;
-						reps = 0;
-					}
-					if(reps != 0){
-						reps -= 4;
-					}
-					do_cmds[do_cmd_count] = reps;
-					do_cmd_count++;
-				}
+// Manual update of outputs
+void cmd_man(unsigned int buf_len, int local_status){
+	unsigned int manual_state;
+	int parsed = sscanf(serial_buf, "%*s %x", &manual_state);
+	if(parsed != 1){
+		fast_serial_printf("invalid request\r\n");
+	}
+	// bits above the output word are commands to core1
+	else if(manual_state & ~OUTPUT_WORD_MASK){
+		fast_serial_printf("Invalid output specification %x\r\n", manual_state);
+	}
+	else{
+		// bit-shift state up by one to signal manual update
+		multicore_fifo_push_blocking(manual_state);
+		fast_serial_printf("ok\r\n");
+	}
+}
 
-				inst_count -= inst_per_buffer;
-			}
+// Get current output state
+void cmd_gto(unsigned int buf_len, int local_status){
+	unsigned int all_state = gpio_get_all();
+	unsigned int manual_state = (output_mask & all_state) >> OUTPUT_PIN_BASE;
+	fast_serial_printf("%x\r\n", manual_state);
+}
 
-			// In this if statement, we read a final serial buffer and load it into do_cmds.
-			if(inst_count > 0){
-				fast_serial_read(serial_buf, 6*inst_count);
-
-				for(int i = 0; i < inst_count; i++){
-					do_cmds[do_cmd_count] = (serial_buf[6*i+1] << 8) | serial_buf[6*i];
-					do_cmd_count++;
-					uint32_t reps = ((serial_buf[6*i+5] << 24)
-									 | (serial_buf[6*i+4] << 16)
-									 | (serial_buf[6*i+3] << 8)
-									 | serial_buf[6*i+2]);
-					if(reps < 5 && reps != 0){
-						reps_error_count++;
-						last_reps_error_idx = (do_cmd_count + 1) / 2;
-						reps = 0;
-					}
-					if(reps != 0){
-						reps -= 4;
-					}
-					do_cmds[do_cmd_count] = reps;
-					do_cmd_count++;
-				}
+// Set instruction by address
+void cmd_set(unsigned int buf_len, int local_status){
+	uint32_t addr;
+	uint32_t do_cmd_addr;
+	uint32_t output;
+	uint32_t reps;
+	int parsed = sscanf(serial_buf, "%*s %x %x %x", &addr, &output, &reps);
+	if (parsed < 3) {
+		fast_serial_printf("Invalid instruction\r\n");
+	}
+	else if (addr >= MAX_INSTR){
+		fast_serial_printf("Invalid instruction address %x\r\n", addr);
+	}
+	// confirm output is valid
+	else if(output & ~OUTPUT_WORD_MASK){
+		fast_serial_printf("Invalid output specification %x\r\n", output);
+	}
+	// confirm reps is valid, if it is a parameter of a wait with a mode
+	// (any other reps is a wait mode or a duration)
+	else if(!decode_instruction(addr, output, reps)){
+		fast_serial_printf("Invalid wait parameter %x\r\n", reps);
+	}
+	else {
+		do_cmd_addr = addr * 2;
+		reps = do_cmds[do_cmd_addr + 1];
+		// update do_cmd_count if we have increased it
+		if(do_cmd_addr+1 > do_cmd_count){
+			// +2 to account for zero indexing of addr
+			do_cmd_count = do_cmd_addr + 2;
+		}
+		else if(reps == 0 && addr != 0 && do_cmds[do_cmd_addr-1] == 0
+				&& wait_param_mode(addr) == WAIT_PLAIN
+				&& wait_param_mode(addr-1) == WAIT_PLAIN
+				&& !is_branch_target(addr) && !is_branch_target(addr-1)){
+			// reset if we just set a stop command (two reps=0 commands in a row)
+			do_cmd_count = do_cmd_addr + 2;
+		}
+		if (debug){
+			fast_serial_printf("NumNZ: %x, Arr Idx: %x, Output: %x, Reps: %x\r\n", 
+				do_cmd_count, do_cmd_addr, output, reps);
+		}
+		fast_serial_printf("ok\r\n");
+	}
+}
+
+// Get instruction at address
+void cmd_get(unsigned int buf_len, int local_status){
+	uint32_t addr;
+	uint32_t output;
+	uint32_t reps;
+	int parsed = sscanf(serial_buf, "%*s %x", &addr);
+	if(parsed < 1){
+		fast_serial_printf("Invalid request\r\n");
+	}
+	else if(addr*2+1 > do_cmd_count){
+		fast_serial_printf("Invalid address\r\n");
+	}
+	else {
+		read_instruction(addr, &output, &reps);
+		fast_serial_printf("%x %x\r\n", output, reps);
+	}
+}
+
+// Add command: read in hexadecimal integers separated by newlines, 
+// append to command array
+void cmd_add(unsigned int buf_len, int local_status){
+	while(do_cmd_count < MAX_DO_CMDS-3){
+		uint32_t output;
+		uint64_t reps;
+		unsigned short num_inputs = 0;
+
+		do {
+		// Read in the command provided by the user
+		// FORMAT: <output> <reps> <REPS = 0: Indefinite Wait>
+			buf_len = fast_serial_read_until(serial_buf, SERIAL_BUFFER_SIZE, '\n');
+
+		// Check if the user inputted "end", and if so, exit add mode
+		if(buf_len >= 3){
+			if(strncmp(serial_buf, "end", 3) == 0){
+				break; // breaks inner read loop
 			}
+		}
 
-			if(reps_error_count > 0){
-				fast_serial_printf("Invalid number of reps in %d instructions, most recent error at instruction %d. Setting reps to zero for these instructions.\r\n", reps_error_count, last_reps_error_idx);
+		// Read the input provided in the serial buffer into the 
+		// output, and reps variables. Also storing the return
+		// value of sscanf (number of variables successfully read in)
+		// to determine if the user wants to program a stop/wait
+		num_inputs = sscanf(serial_buf, "%x %" SCNx64, &output, &reps);
+
+		} while (num_inputs < 2);
+
+		if(strncmp(serial_buf, "end", 3) == 0){
+			if(auto_normalise){
+				normalise_saved = normalise_instructions();
 			}
-			else{
-				fast_serial_printf("ok\r\n");
+			fast_serial_printf("ok\r\n");
+			break; // breaks add mode loop
+		}
+
+		//DEBUG MODE:
+		// Printing to the user what the program received as input
+		// for the output, reps, and optionally wait if the user inputted
+		// that
+		if (debug) {
+			fast_serial_printf("Output: %x\r\n", output);
+			fast_serial_printf("Number of Reps: %" PRIu64 "\r\n", reps);
+
+			if (reps == 0){
+				fast_serial_printf("Wait\r\n");
 			}
 		}
-		// Dump command: print the currently loaded buffered outputs
-		else if(strncmp(serial_buf, "dmp", 3) == 0){
-			// Dump
-			for(int i = 0; do_cmd_count > 0 && i < do_cmd_count - 1; i++){
-				// Printing out the output word
-				fast_serial_printf("do_cmd: %04x\r\n", do_cmds[i]);
-				i++;
-
-				// Either printing out the number of reps, or if the number
-				// of reps equals zero printing out whether it is a full stop
-				// or an indefinite wait
-				if (do_cmds[i] == 0){
-					fast_serial_printf("\tWait\r\n");
-				}
-				else {
-					fast_serial_printf("\treps: %x\r\n", do_cmds[i]+4);
-				}
-				
+
+		// confirm output is valid
+		if(output & ~OUTPUT_WORD_MASK){
+			fast_serial_printf("Invalid output specification %x\r\n", output);
+			break;
+		}
+		// confirm reps is valid (a parameter, if this follows a wait with a mode)
+		uint32_t mode = wait_param_mode(do_cmd_count / 2);
+		uint32_t x;
+		if(is_branch_target(do_cmd_count / 2)){
+			if(reps > MAX_REPS){
+				fast_serial_printf("Invalid branch target %" PRIx64 "\r\n", reps);
+				break;
 			}
 		}
-		// Program length command: print number of instructions currently in program
-		else if (strncmp(serial_buf, "len", 3) == 0){
-			fast_serial_printf("Number of command lines: %d\r\n", do_cmd_count);
-			fast_serial_printf("Number of instructions: %d\r\n", do_cmd_count/2);
-		}
-		// Clk configuration command
-		// FORMAT: clk <src:0,1> <freq:int>
-		else if (strncmp(serial_buf, "clk", 3) == 0){
-			unsigned int src; // 0 = internal, 1 = external (GPIO pin 20)
-			unsigned int freq; // in Hz (up to 133 MHz or 150 MHz depending on board)
-			int parsed = sscanf(serial_buf, "%*s %u %u", &src, &freq);
-			// validation checks of the inputs
-			if (parsed < 2) {
-				fast_serial_printf("invalid clock request\r\n");
-				continue;
-			} else if (src > 2) {
-				fast_serial_printf("invalid clock source request\r\n");
-				continue;
-#if PRAWNDO_PICO_BOARD == 1
-			} else if (freq > 133000000) {
-#elif PRAWNDO_PICO_BOARD == 2
-			} else if (freq > 150000000) {
-#else
-#    error "Unsupported PICO_BOARD"
-#endif // PRAWNDO_PICO_BOARD
-				fast_serial_printf("invalid clock frequency request\r\n");
-				continue;
+		else if(mode != WAIT_PLAIN){
+			if(reps > MAX_REPS || !encode_wait_param(mode, reps, &x)){
+				fast_serial_printf("Invalid wait parameter %x\r\n", (uint32_t) reps);
+				break;
 			}
-			// set new clock source and frequency
-			if (src == 0) { // internal
-				if (set_sys_clock_khz(freq / 1000, false)) {
-					fast_serial_printf("ok\r\n");
-					clk_status = INTERNAL;
-				} else {
-					fast_serial_printf("Failure. Cannot exactly achieve that clock frequency\r\n");
-				}
-			} else { // external
-				// update status first, then resus can correct of configuration fails
-				clk_status = EXTERNAL;
-				clock_configure_gpin(clk_sys, 20, freq, freq);
-				fast_serial_printf("ok\r\n");
+			if(mode == WAIT_BRANCH && (output == 0 || output > prawn_do_NUM_BRANCH_PINS)){
+				fast_serial_printf("Invalid number of branch pins %x\r\n", output);
+				break;
 			}
 		}
-		// Editing the current command with the instruction provided by the
-		// user 
-		// FORMAT: <output> <reps> <REPS = 0: Indefinite Wait>
-		else if (strncmp(serial_buf, "edt", 3) == 0) {
-			if (do_cmd_count > 0) {
-				uint32_t output;
-				uint32_t reps;
-				unsigned short num_inputs;
-			
-				do {
-					// Reading in an instruction from the user serial input
-					fast_serial_read_until(serial_buf, SERIAL_BUFFER_SIZE, '\n');
-
-					// Storing the input from the user into the respective output,
-					// and reps variables to be stored in memory
-					num_inputs = sscanf(serial_buf, "%x %x", &output, &reps);
-
-				} while (num_inputs < 2);
-				// Immediately replacing the output and reps stored for the
-				// last sequence with the newly inputted values
-				do_cmds[do_cmd_count - 2] = output;
-				do_cmds[do_cmd_count - 1] = reps;
-
-			} else {
-				fast_serial_printf("No commands to edit\r\n");
-			}
-			fast_serial_printf("ok\r\n");
+
+		// Store the instruction, splitting durations longer than
+		// MAX_REPS across as many instructions as needed
+		uint32_t stored = 1;
+		if(reps > MAX_REPS){
+			stored = store_chained(do_cmd_count / 2, output, reps);
+		}
+		else{
+			decode_instruction(do_cmd_count / 2, output, reps);
+		}
+		if(stored == 0){
+			fast_serial_printf("Too many DO commands (%d). Please use resources more efficiently.\r\n", MAX_DO_CMDS);
+			break;
+		}
+		do_cmd_count += 2 * stored;
 		
+	}
+	if(do_cmd_count == MAX_DO_CMDS-1){
+		fast_serial_printf("Too many DO commands (%d). Please use resources more efficiently.\r\n", MAX_DO_CMDS);
+	}
+}
+
+// Add many command: read in a fixed number of binary integers without separation,
+// append to command array
+void cmd_adm(unsigned int buf_len, int local_status){
+	// Get how many instructions this adm command contains and where to insert them
+	uint32_t start_addr;
+	uint32_t inst_count;
+	int parsed = sscanf(serial_buf, "%*s %x %x", &start_addr, &inst_count);
+	if(parsed < 2){
+		fast_serial_printf("Invalid request\r\n");
+		return;
+	}
+	// Check that the instructions will fit in the do_cmds array
+	else if(inst_count + start_addr > MAX_INSTR){
+		fast_serial_printf("Invalid address and/or too many instructions (%d + %d).\r\n", start_addr, inst_count);
+		return;
+	}
+	else{
+		fast_serial_printf("ready\r\n");
+	}
+
+	// Hand the upload to core1, which decodes records as they arrive
+	uint64_t upload_start = time_us_64();
+	decode_addr = start_addr;
+	decode_count = inst_count;
+	decode_error_count = 0;
+	decode_last_error = 0;
+	decode_head = 0;
+	decode_tail = 0;
+	multicore_fifo_push_blocking(DECODE);
+
+	// It takes ADM_RECORD_SIZE bytes to describe an instruction: OUTPUT_BYTES bytes for values, 4 bytes for time
+	// In this loop, we only move the bytes from USB into the ring
+	uint32_t bytes_left = ADM_RECORD_SIZE * inst_count;
+	while(bytes_left > 0){
+		uint32_t pos = decode_head % DECODE_RING_SIZE;
+		uint32_t space = DECODE_RING_SIZE - (decode_head - decode_tail);
+		if(space > DECODE_RING_SIZE - pos){
+			space = DECODE_RING_SIZE - pos;
 		}
-		// Printing out the latest digital output command added to the current 
-		// running program
-		else if (strncmp(serial_buf, "cur", 3) == 0) {
-				fast_serial_printf("Output: %x\r\n", do_cmds[do_cmd_count - 2]);
-				fast_serial_printf("Reps: %d\r\n", do_cmds[do_cmd_count - 1] + 4);
-				if(do_cmds[do_cmd_count - 1] == 0){
-					fast_serial_printf("Wait\r\n");
-				}
+		if(space > bytes_left){
+			space = bytes_left;
+		}
+		uint32_t read_avail = fast_serial_read_available();
+		if(space > read_avail){
+			space = read_avail;
+		}
+		if(space > 0){
+			uint32_t received = fast_serial_read_atomic(&decode_ring[pos], space);
+			// publish the records only once they are written
+			__dmb();
+			decode_head += received;
+			bytes_left -= received;
+		}
+		fast_serial_task();
+	}
+	// wait for core1 to finish decoding
+	multicore_fifo_pop_blocking();
+	bench_adm_bytes = ADM_RECORD_SIZE * inst_count;
+	bench_adm_us = time_us_64() - upload_start;
+	set_do_cmd_count(2 * (start_addr + inst_count));
+	uint32_t reps_error_count = decode_error_count;
+	uint32_t last_reps_error_idx = decode_last_error;
+
+	if(auto_normalise){
+		normalise_saved = normalise_instructions();
+	}
+
+	if(reps_error_count > 0){
+		fast_serial_printf("Invalid wait param in %d instructions, last at %d. Set to min.\r\n", reps_error_count, last_reps_error_idx);
+	}
+	else{
+		fast_serial_printf("ok\r\n");
+	}
+}
+
+// Dump command: print the currently loaded buffered outputs
+void cmd_dmp(unsigned int buf_len, int local_status){
+	// Dump
+	for(uint32_t addr = 0; addr < do_cmd_count / 2; addr++){
+		uint32_t output;
+		uint32_t reps;
+		read_instruction(addr, &output, &reps);
+		// Printing out the output word
+		fast_serial_printf("do_cmd: %0*x\r\n", OUTPUT_HEX_DIGITS, output);
+
+		// Either printing out the number of reps, the parameter of
+		// a wait, or if the number of reps equals zero printing out
+		// whether it is a full stop or an indefinite wait (and its mode)
+		if (is_branch_target(addr)){
+			fast_serial_printf("\ttarget: %x\r\n", reps);
+		}
+		else if (wait_param_mode(addr) != WAIT_PLAIN){
+			fast_serial_printf("\tparam: %x\r\n", reps);
+		}
+		else if (do_cmds[2*addr + 1] == 0 && reps != WAIT_PLAIN){
+			fast_serial_printf("\tWait (mode %d)\r\n", reps);
+		}
+		else if (do_cmds[2*addr + 1] == 0){
+			fast_serial_printf("\tWait\r\n");
+		}
+		else {
+			fast_serial_printf("\treps: %x\r\n", reps);
 		}
-		// Measure system frequencies
-		else if(strncmp(serial_buf, "frq", 3) == 0) {
-			measure_freqs();
+		
+	}
+}
+
+// Program length command: print number of instructions currently in program
+void cmd_len(unsigned int buf_len, int local_status){
+	fast_serial_printf("Number of command lines: %d\r\n", do_cmd_count);
+	fast_serial_printf("Number of instructions: %d\r\n", do_cmd_count/2);
+	fast_serial_printf("Instruction capacity: %d\r\n", MAX_INSTR);
+	fast_serial_printf("Instructions saved by normalisation: %d\r\n", normalise_saved);
+}
+
+// Save command: store the sequence in a flash bank
+// FORMAT: sav <bank>
+void cmd_sav(unsigned int buf_len, int local_status){
+	uint32_t bank = 0;
+	sscanf(serial_buf, "%*s %x", &bank);
+	if(bank >= NUM_SAVE_BANKS){
+		fast_serial_printf("Invalid bank %x\r\n", bank);
+	}
+	else if(save_sequence(bank)){
+		fast_serial_printf("ok\r\n");
+	}
+}
+
+// Load command: restore the sequence from a flash bank
+// FORMAT: lod <bank>
+void cmd_lod(unsigned int buf_len, int local_status){
+	uint32_t bank = 0;
+	sscanf(serial_buf, "%*s %x", &bank);
+	if(bank >= NUM_SAVE_BANKS){
+		fast_serial_printf("Invalid bank %x\r\n", bank);
+	}
+	else if(load_sequence(bank)){
+		fast_serial_printf("ok\r\n");
+	}
+}
+
+// Boot option command: load (and arm) a saved sequence at boot
+// FORMAT: aut <bank> <0: nothing, 1: load, 2: load and arm>
+void cmd_aut(unsigned int buf_len, int local_status){
+	uint32_t bank;
+	uint32_t boot;
+	int parsed = sscanf(serial_buf, "%*s %x %x", &bank, &boot);
+	if(parsed < 2 || bank >= NUM_SAVE_BANKS || boot > BOOT_RUN){
+		fast_serial_printf("Invalid request\r\n");
+	}
+	else if(set_boot_bank(bank, boot)){
+		fast_serial_printf("ok\r\n");
+	}
+}
+
+// Stress test command: check the DMA keeps up with minimum length pulses
+// FORMAT: tst <duration in ms>
+void cmd_tst(unsigned int buf_len, int local_status){
+	unsigned int duration;
+	int parsed = sscanf(serial_buf, "%*s %u", &duration);
+	if(parsed < 1){
+		fast_serial_printf("Invalid request\r\n");
+		return;
+	}
+	stress_test(duration);
+}
+
+// Normalise command: merge and re-split the programmed sequence now
+void cmd_nrm(unsigned int buf_len, int local_status){
+	if(has_branches()){
+		fast_serial_printf("Cannot normalise a sequence with branches\r\n");
+		return;
+	}
+	normalise_saved = normalise_instructions();
+	fast_serial_printf("Instructions saved: %d\r\n", normalise_saved);
+}
+
+// Enable normalisation after every add/adm
+void cmd_anm(unsigned int buf_len, int local_status){
+	auto_normalise = 1;
+	fast_serial_printf("ok\r\n");
+}
+
+// Disable normalisation after add/adm
+void cmd_nnm(unsigned int buf_len, int local_status){
+	auto_normalise = 0;
+	fast_serial_printf("ok\r\n");
+}
+
+// Clk configuration command
+// FORMAT: clk <src:0,1> <freq:int>
+void cmd_clk(unsigned int buf_len, int local_status){
+	unsigned int src; // 0 = internal, 1 = external (GPIO pin 20)
+	unsigned int freq; // in Hz (up to MAX_SYS_CLOCK_HZ, depending on board and build)
+	int parsed = sscanf(serial_buf, "%*s %u %u", &src, &freq);
+	// validation checks of the inputs
+	if (parsed < 2) {
+		fast_serial_printf("invalid clock request\r\n");
+		return;
+	} else if (src > 2) {
+		fast_serial_printf("invalid clock source request\r\n");
+		return;
+	} else if (freq > MAX_SYS_CLOCK_HZ) {
+		fast_serial_printf("invalid clock frequency request\r\n");
+		return;
+	}
+	// set new clock source and frequency
+	if (src == 0) { // internal
+		if (set_sys_clock_khz(freq / 1000, false)) {
+			fast_serial_printf("ok\r\n");
+			clock_lost = 0;
+			clk_status = INTERNAL;
+		} else {
+			fast_serial_printf("Failure. Cannot exactly achieve that clock frequency\r\n");
+		}
+	} else { // external
+		// update status first, then resus can correct of configuration fails
+		uint32_t interrupts = save_and_disable_interrupts();
+		clock_ext_freq = freq;
+		clock_lost = 0;
+		clock_locked = 0;
+		clock_drift_ppm = 0;
+		max_clock_drift_ppm = 0;
+		clk_status = EXTERNAL;
+		clock_configure_gpin(clk_sys, CLOCK_IN_PIN, freq, freq);
+		// the monitor's first window starts with the new clock
+		clock_window_periods = 0;
+		clock_window_cycles = 0;
+		clock_last_systick = systick_hw->cvr;
+		clock_last_tick_us = time_us_64();
+		clock_window_start_us = clock_last_tick_us;
+		restore_interrupts(interrupts);
+		fast_serial_printf("ok\r\n");
+	}
+}
+
+// Editing the current command with the instruction provided by the
+// user 
+// FORMAT: <output> <reps> <REPS = 0: Indefinite Wait>
+void cmd_edt(unsigned int buf_len, int local_status){
+	if (do_cmd_count > 0) {
+		uint32_t output;
+		uint32_t reps;
+		unsigned short num_inputs;
+	
+		do {
+			// Reading in an instruction from the user serial input
+			fast_serial_read_until(serial_buf, SERIAL_BUFFER_SIZE, '\n');
+
+			// Storing the input from the user into the respective output,
+			// and reps variables to be stored in memory
+			num_inputs = sscanf(serial_buf, "%x %x", &output, &reps);
+
+		} while (num_inputs < 2);
+		// Immediately replacing the output and reps stored for the
+		// last sequence with the newly inputted values
+		do_cmds[do_cmd_count - 2] = output;
+		do_cmds[do_cmd_count - 1] = reps;
+		branch_index_valid = 0;
+		invalidate_timing(do_cmd_count / 2 - 1);
+
+	} else {
+		fast_serial_printf("No commands to edit\r\n");
+	}
+	fast_serial_printf("ok\r\n");
+}
+
+// Printing out the latest digital output command added to the current 
+// running program
+void cmd_cur(unsigned int buf_len, int local_status){
+	fast_serial_printf("Output: %x\r\n", do_cmds[do_cmd_count - 2]);
+	fast_serial_printf("Reps: %d\r\n", do_cmds[do_cmd_count - 1] + 4);
+	if(do_cmds[do_cmd_count - 1] == 0){
+		fast_serial_printf("Wait\r\n");
+	}
+}
+
+// Measure system frequencies
+void cmd_frq(unsigned int buf_len, int local_status){
+	measure_freqs();
+}
+
+// Reboot into programming mode
+void cmd_prg(unsigned int buf_len, int local_status){
+	reset_usb_boot(0, 0);
+}
+
+/*
+  Command table
+
+  Commands are looked up by name for text commands, and by position (the
+  opcode) for framed commands, so new commands must only be added at the end.
+ */
+#define CMD_WHILE_RUNNING 1 // allowed during buffered execution
+#define CMD_INTERACTIVE 2 // reads more from the serial port (or streams output), so cannot be framed
+struct command {
+	char name[4];
+	void (*handler)(unsigned int buf_len, int local_status);
+	unsigned int flags;
+};
+const struct command commands[] = {
+	{"ver", cmd_ver, CMD_WHILE_RUNNING},
+	{"brd", cmd_brd, CMD_WHILE_RUNNING},
+	{"sts", cmd_sts, CMD_WHILE_RUNNING},
+	{"tlm", cmd_tlm, CMD_WHILE_RUNNING},
+	{"deb", cmd_deb, CMD_WHILE_RUNNING},
+	{"ndb", cmd_ndb, CMD_WHILE_RUNNING},
+	{"abt", cmd_abt, CMD_WHILE_RUNNING},
+	{"cls", cmd_cls, 0},
+	{"run", cmd_run, 0},
+	{"swr", cmd_swr, 0},
+	{"per", cmd_per, 0},
+	{"man", cmd_man, 0},
+	{"gto", cmd_gto, 0},
+	{"set", cmd_set, 0},
+	{"get", cmd_get, 0},
+	{"add", cmd_add, CMD_INTERACTIVE},
+	{"adm", cmd_adm, CMD_INTERACTIVE},
+	{"dmp", cmd_dmp, 0},
+	{"len", cmd_len, 0},
+	{"sav", cmd_sav, 0},
+	{"lod", cmd_lod, 0},
+	{"aut", cmd_aut, 0},
+	{"tst", cmd_tst, CMD_INTERACTIVE},
+	{"nrm", cmd_nrm, 0},
+	{"anm", cmd_anm, 0},
+	{"nnm", cmd_nnm, 0},
+	{"clk", cmd_clk, 0},
+	{"edt", cmd_edt, CMD_INTERACTIVE},
+	{"cur", cmd_cur, 0},
+	{"frq", cmd_frq, 0},
+	{"prg", cmd_prg, 0},
+	{"pos", cmd_pos, CMD_WHILE_RUNNING},
+	{"tim", cmd_tim, CMD_WHILE_RUNNING},
+	{"bch", cmd_bch, CMD_WHILE_RUNNING},
+	{"msk", cmd_msk, 0},
+};
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/*
+  Run a command, counting its cost for bch (except for bch itself)
+ */
+void run_command(const struct command * command, unsigned int buf_len, int local_status){
+	uint64_t write_cycles = fast_serial_write_cycles;
+	uint64_t start_us = time_us_64();
+	uint32_t start = systick_hw->cvr;
+	command->handler(buf_len, local_status);
+	if(command->handler != cmd_bch){
+		bench_handler_cycles += cycles_since(start, start_us);
+		bench_write_cycles += fast_serial_write_cycles - write_cycles;
+		bench_commands++;
+	}
+}
+
+// Find the command named by the first three characters of buf
+const struct command * find_command(const char * buf){
+	for(uint32_t i = 0; i < NUM_COMMANDS; i++){
+		if(strncmp(buf, commands[i].name, 3) == 0){
+			return &commands[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+  Framed commands
+
+  As well as text lines, commands can be sent as binary frames, so a host
+  can send several without waiting and match the responses by request ID:
+    start byte (FRAME_START), opcode (position in commands), request ID (16 bit),
+    argument length (16 bit), arguments (as text, as after the command name),
+    CRC-16/CCITT of everything after the start byte
+  Responses are framed the same way, with a status byte after the request ID
+  and the text the command printed as the payload. All multi-byte fields are
+  little endian.
+ */
+#define FRAME_START 0xA5
+#define FRAME_OK 0
+#define FRAME_BAD_CRC 1
+#define FRAME_BAD_OPCODE 2
+#define FRAME_NOT_ALLOWED 3 // payload says why
+#define FRAME_TRUNCATED 4 // response did not fit in the frame
+#define FRAME_DROPPED 5 // too long or incomplete, dropped with the input after it
+#define FRAME_RESPONSE_SIZE 1024
+// longest arguments that fit in serial_buf after the command name and a space
+#define FRAME_MAX_ARGS (SERIAL_BUFFER_SIZE - 5)
+// how long to wait for the next byte of a frame before dropping it
+#define FRAME_TIMEOUT_US 100000
+char frame_response[FRAME_RESPONSE_SIZE + 9];
+
+// Send a response frame, with the payload already in frame_response
+void send_frame(uint8_t opcode, uint16_t id, uint8_t frame_status, uint16_t len){
+	frame_response[0] = FRAME_START;
+	frame_response[1] = opcode;
+	frame_response[2] = id & 0xFF;
+	frame_response[3] = id >> 8;
+	frame_response[4] = frame_status;
+	frame_response[5] = len & 0xFF;
+	frame_response[6] = len >> 8;
+	uint16_t crc = fast_serial_crc16(frame_response + 1, 6 + len, 0xFFFF);
+	frame_response[7 + len] = crc & 0xFF;
+	frame_response[8 + len] = crc >> 8;
+	fast_serial_write(frame_response, 9 + len);
+}
+
+/*
+  Read and run one framed command (the start byte has already been read)
+ */
+void handle_frame(int local_status){
+	uint8_t header[5] = {0};
+	uint32_t header_len = fast_serial_read_timeout((const char *) header, 5, FRAME_TIMEOUT_US);
+	uint8_t opcode = header[0];
+	uint16_t id = header[1] | (header[2] << 8);
+	uint16_t len = header[3] | (header[4] << 8);
+	uint16_t crc = fast_serial_crc16(header, 5, 0xFFFF);
+
+	// The length is not covered by a checked CRC yet, so a frame that is
+	// too long is not read, and one that stops arriving is given up on.
+	// Either way, whatever is left of it cannot be told apart from the
+	// next command, so the pending input is dropped too.
+	uint8_t sent_crc[2];
+	if(header_len < 5 || len > FRAME_MAX_ARGS
+	   || fast_serial_read_timeout(serial_buf + 4, len, FRAME_TIMEOUT_US) < len
+	   || fast_serial_read_timeout((const char *) sent_crc, 2, FRAME_TIMEOUT_US) < 2){
+		fast_serial_read_flush();
+		send_frame(opcode, id, FRAME_DROPPED, 0);
+		return;
+	}
+	// The arguments follow the command name, so handlers can parse
+	// serial_buf exactly as for a text command
+	uint32_t arg_len = len;
+	crc = fast_serial_crc16(serial_buf + 4, arg_len, crc);
+
+	char * payload = frame_response + 7;
+	if(crc != (sent_crc[0] | (sent_crc[1] << 8))){
+		send_frame(opcode, id, FRAME_BAD_CRC, 0);
+		return;
+	}
+	if(opcode >= NUM_COMMANDS){
+		send_frame(opcode, id, FRAME_BAD_OPCODE, 0);
+		return;
+	}
+	const struct command * command = &commands[opcode];
+	memcpy(serial_buf, command->name, 3);
+	serial_buf[3] = ' ';
+	serial_buf[4 + arg_len] = '\0';
+
+	if(command->flags & CMD_INTERACTIVE){
+		uint16_t msg_len = snprintf(payload, FRAME_RESPONSE_SIZE, "Command %s cannot be framed\r\n", command->name);
+		send_frame(opcode, id, FRAME_NOT_ALLOWED, msg_len);
+		return;
+	}
+	if(!(command->flags & CMD_WHILE_RUNNING) && local_status != ABORTED && local_status != STOPPED){
+		uint16_t msg_len = snprintf(payload, FRAME_RESPONSE_SIZE, "Cannot execute command %s during buffered execution.\r\n", command->name);
+		send_frame(opcode, id, FRAME_NOT_ALLOWED, msg_len);
+		return;
+	}
+	bool overflow;
+	fast_serial_capture_start(payload, FRAME_RESPONSE_SIZE);
+	run_command(command, 4 + arg_len, local_status);
+	uint16_t response_len = fast_serial_capture_end(&overflow);
+	send_frame(opcode, id, overflow ? FRAME_TRUNCATED : FRAME_OK, response_len);
+}
+
+int main(){
+
+	// initialize status mutex
+	mutex_init(&status_mutex);
+	
+	// Setup serial
+	fast_serial_init();
+
+	// By default, set the system clock to 100 MHz (200 MHz if overclocked)
+	init_sys_clock();
+
+	// Take the free RAM for the instruction table
+	init_do_cmds();
+
+	// Allow the clock to be restarted in case of any errors
+	clocks_enable_resus(&clk_resus);
+
+	// Give the DMA priority over both cores on the bus, so feeding the PIO
+	// never waits behind the CPUs
+	bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_R_BITS | BUSCTRL_BUS_PRIORITY_DMA_W_BITS;
+
+	// Free running SysTick on the processor clock, for bch and the clock
+	// monitor
+	systick_hw->rvr = 0xFFFFFF;
+	systick_hw->cvr = 0;
+	systick_hw->csr = 0x5;
+	clock_last_systick = systick_hw->cvr;
+	clock_last_tick_us = time_us_64();
+	add_repeating_timer_ms(CLOCK_MONITOR_MS, clock_monitor, NULL, &clock_monitor_timer);
+
+	// Turn on onboard LED (to indicate device is starting)
+	gpio_init(LED_PIN);
+	gpio_set_dir(LED_PIN, GPIO_OUT);
+	gpio_put(LED_PIN, 1);
+
+	// Finish startup
+	fast_serial_printf("Prawn Digital Output online\r\n");
+	gpio_put(LED_PIN, 0);
+
+	multicore_launch_core1(core1_entry);
+    multicore_fifo_pop_blocking();
+
+	// Set status to off
+	set_status(STOPPED);
+
+	// Restore a saved sequence, if one was saved with a boot option
+	boot_load_sequence();
+
+
+	while(1){
+		
+		// Prompt for user command
+		// PIO runs independently, so CPU spends most of its time waiting here
+		gpio_put(LED_PIN, 1); // turn on LED while waiting for user
+		while(fast_serial_read_available() == 0){
+			fast_serial_task();
+			clock_relock_task();
 		}
-		// Reboot into programming mode
-		else if(strncmp(serial_buf, "prg", 3) == 0) {
-			reset_usb_boot(0, 0);
+		fast_serial_read(serial_buf, 1);
+		uint64_t read_start_us = time_us_64();
+		uint32_t read_start = systick_hw->cvr;
+		if(serial_buf[0] == (char) FRAME_START){
+			gpio_put(LED_PIN, 0);
+			handle_frame(get_status());
+			continue;
+		}
+		unsigned int buf_len = 1;
+		if(serial_buf[0] != '\n'){
+			buf_len += fast_serial_read_until(serial_buf + 1, SERIAL_BUFFER_SIZE - 1, '\n');
 		}
 		else{
+			serial_buf[1] = '\0';
+		}
+		bench_read_cycles += cycles_since(read_start, read_start_us);
+		bench_lines++;
+		gpio_put(LED_PIN, 0);
+		int local_status = get_status();
+
+		// Check for command validity, all are at least three characters long
+		if(buf_len < 3){
 			fast_serial_printf("Invalid command: %s\r\n", serial_buf);
+			continue;
+		}
+
+		const struct command * command = find_command(serial_buf);
+		if(command == NULL){
+			fast_serial_printf("Invalid command: %s\r\n", serial_buf);
+		}
+		// Most commands can only happen in manual mode
+		else if(!(command->flags & CMD_WHILE_RUNNING)
+				&& local_status != ABORTED && local_status != STOPPED){
+			fast_serial_printf("Cannot execute command %s during buffered execution.\r\n", serial_buf);
+		}
+		else{
+			run_command(command, buf_len, local_status);
 		}
 	}
 }
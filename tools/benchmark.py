@@ -0,0 +1,165 @@
+"""
+Benchmark a PrawnDO board over USB serial.
+
+Measures, from the host, the command rate (round trips per second) of the
+common commands, the instruction rates of add and adm, and collects the
+firmware's own measurements from bch (cycles per command spent receiving,
+handling and writing responses, and sscanf) and tlm (arm and abort latency).
+
+Results are written as JSON so runs on different firmware versions can be
+compared, e.g.
+
+    python benchmark.py COM5 --output rp2350-1.3.0.json
+
+Requires pyserial. This replaces the sequence programmed on the board.
+
+No baseline results are kept in the repository, as they depend on the board,
+host and USB connection: record one with the firmware being compared against
+on the same setup. If a step fails, the results of the steps before it are
+still written.
+"""
+import argparse
+import json
+import struct
+import time
+
+import serial
+
+
+def command(do, cmd):
+    do.write(f'{cmd}\r\n'.encode())
+    return do.readline().decode()
+
+
+def command_lines(do, cmd):
+    """Send a command with a multi-line response, using sts to find its end"""
+    do.write(f'{cmd}\r\nsts\r\n'.encode())
+    lines = []
+    while True:
+        line = do.readline().decode()
+        if not line:
+            raise TimeoutError(f'No response to {cmd}')
+        if line.startswith('run-status:'):
+            return lines
+        lines.append(line)
+
+
+def fields(lines):
+    """Parse 'name: value [name: value...]' response lines into a dict"""
+    values = {}
+    for line in lines:
+        tokens = line.replace(':', ' ').split()
+        prefix = tokens[0]
+        values[prefix] = int(tokens[1])
+        for name, value in zip(tokens[2::2], tokens[3::2]):
+            values[f'{prefix}-{name}'] = int(value)
+    return values
+
+
+def rate(do, cmd, reps):
+    start = time.perf_counter()
+    for _ in range(reps):
+        resp = command(do, cmd)
+        assert resp, f'No response to {cmd}'
+    elapsed = time.perf_counter() - start
+    return {'commands_per_s': reps / elapsed, 'mean_ms': 1e3 * elapsed / reps}
+
+
+def bench_add(do, count):
+    assert command(do, 'cls') == 'ok\r\n'
+    start = time.perf_counter()
+    do.write(b'add\r\n')
+    do.write(b''.join(f'{i & 1:x} 64\r\n'.encode() for i in range(count)))
+    do.write(b'end\r\n')
+    resp = do.readline().decode()
+    elapsed = time.perf_counter() - start
+    assert resp == 'ok\r\n', f'add failed: {resp!r}'
+    return {'instructions': count, 'instructions_per_s': count / elapsed}
+
+
+def bench_adm(do, count, output_bytes):
+    record = struct.Struct(f'<{output_bytes}sI')
+    data = b''.join(record.pack((i & 1).to_bytes(output_bytes, 'little'), 100)
+                    for i in range(count))
+    start = time.perf_counter()
+    resp = command(do, f'adm 0 {count:x}')
+    assert resp == 'ready\r\n', f'adm not ready: {resp!r}'
+    do.write(data)
+    resp = do.readline().decode()
+    elapsed = time.perf_counter() - start
+    assert resp == 'ok\r\n', f'adm failed: {resp!r}'
+    return {'instructions': count, 'bytes': len(data), 'mb_per_s': len(data) / elapsed / 1e6}
+
+
+def wait_status(do, done, polls=1000):
+    """Poll sts until its run status is one of done, and return it"""
+    for _ in range(polls):
+        resp = command(do, 'sts')
+        if not resp.startswith('run-status:'):
+            raise TimeoutError(f'Unexpected sts response {resp!r}')
+        status = int(resp.split()[0].split(':')[1])
+        if status in done:
+            return status
+    raise TimeoutError(f'Run status still {status}, expected one of {done}')
+
+
+def bench_arm_abort(do, reps):
+    # an indefinite wait, an instruction and a stop (two instructions with
+    # 0 reps in a row), so each run stays armed until aborted
+    command(do, 'cls')
+    do.write(b'add\r\n0 0\r\n0 64\r\n0 0\r\n0 0\r\nend\r\n')
+    assert do.readline() == b'ok\r\n'
+    for _ in range(reps):
+        assert command(do, 'swr') == 'ok\r\n'
+        # running (2)
+        wait_status(do, {2})
+        assert command(do, 'abt') == 'ok\r\n'
+        # aborted (5), which lasts until the next run
+        wait_status(do, {0, 5})
+    return fields(command_lines(do, 'tlm'))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('port', help='serial port of the board')
+    parser.add_argument('--reps', type=int, default=1000,
+                        help='round trips per command')
+    parser.add_argument('--instructions', type=int, default=20000,
+                        help='instructions uploaded with add and adm')
+    parser.add_argument('--output-bytes', type=int, default=2,
+                        help='bytes per adm output word (2 for 16 outputs)')
+    parser.add_argument('--output', help='JSON file to write the results to')
+    args = parser.parse_args()
+
+    results = {}
+    try:
+        with serial.Serial(args.port, timeout=5) as do:
+            do.reset_input_buffer()
+            results['version'] = command(do, 'ver').strip()
+            results['date'] = time.strftime('%Y-%m-%d %H:%M:%S')
+            # reset the firmware's counters
+            command_lines(do, 'bch')
+
+            results['round_trips'] = {cmd: rate(do, cmd, args.reps)
+                                      for cmd in ['sts', 'man 0', 'gto', 'ver']}
+            results['add'] = bench_add(do, args.instructions)
+            start = time.perf_counter()
+            command_lines(do, 'dmp')
+            results['dmp'] = {'instructions_per_s': args.instructions / (time.perf_counter() - start)}
+            results['firmware'] = fields(command_lines(do, 'bch'))
+
+            results['adm'] = bench_adm(do, args.instructions, args.output_bytes)
+            results['firmware_adm'] = {name: value for name, value in fields(command_lines(do, 'bch')).items()
+                                       if name.startswith('adm-bytes')}
+            results['telemetry'] = bench_arm_abort(do, 100)
+    finally:
+        # write whatever was measured, even if a step failed
+        print(json.dumps(results, indent=2))
+        if args.output:
+            with open(args.output, 'w') as f:
+                json.dump(results, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()